@@ -24,35 +24,49 @@ command { service = "ChanServ"; name = "SET JOINFLOOD"; command = "chanserv/set/
 /* Store the settings, joins, and bans  */
 struct JoinCounter
 {
+	/* Most joins we keep the times of, and so the highest 'joins' setting */
+	static const unsigned MaxJoins = 32;
+
 	unsigned int joins;
 	time_t secs;
 	time_t duration;
 
-	unsigned int counter;
-	time_t reset;
+	time_t stamps[MaxJoins];	/* Times of the last joins, oldest at 'next' once full */
+	unsigned int next;
+	unsigned int stored;
 	bool engaged;
 	std::vector<Anope::string> banmasks;
 
 	JoinCounter(Extensible *) :
-		joins(0), secs(0), duration(0), counter(0), reset(0), engaged(false) { }
+		joins(0), secs(0), duration(0), next(0), stored(0), engaged(false) { }
 
 	void ResetCounter()
 	{
-		this->reset = Anope::CurTime + this->secs;
-		this->counter = 0;
+		this->next = 0;
+		this->stored = 0;
 	}
 
-	bool ShouldReset()
+	void AddJoin()
 	{
-		return (this->reset <= Anope::CurTime);
+		this->stamps[this->next] = Anope::CurTime;
+		this->next = (this->next + 1) % MaxJoins;
+		if (this->stored < MaxJoins)
+			this->stored++;
 	}
 
+	/* Whether the last 'joins' joins all happened within 'secs' seconds */
 	bool ShouldEngage()
 	{
-		return (this->counter >= this->joins);
+		const unsigned int count = (this->joins > MaxJoins) ? MaxJoins : (this->joins ? this->joins : 1);
+		if (this->stored < count)
+			return false;
+
+		return (this->stamps[(this->next + MaxJoins - count) % MaxJoins] > Anope::CurTime - this->secs);
 	}
 };
 
+const unsigned JoinCounter::MaxJoins;
+
 /* Timer to disengage protection after the set duration */
 class DisengageTimer : public Timer
 {
@@ -60,20 +74,21 @@ class DisengageTimer : public Timer
 	Anope::string channel;
 	Anope::string mode;
 	char symbol;
+	ExtensibleItem<JoinCounter> &joincounter;
 
   public:
-	DisengageTimer(Module *me, time_t seconds, Channel *c, const Anope::string &m, const char &s) : Timer(me, seconds), channel(c->name), mode(m), symbol(s) { }
+	DisengageTimer(Module *me, time_t seconds, Channel *c, const Anope::string &m, const char &s, ExtensibleItem<JoinCounter> &jcitem) : Timer(me, seconds), channel(c->name), mode(m), symbol(s), joincounter(jcitem) { }
 
 	void Tick(time_t) anope_override
 	{
 		Channel *c = Channel::Find(this->channel);
-		if (!c)
+		if (!c || !c->ci)
 			return;
 
 		if (!mode.empty())
 			c->RemoveMode(c->ci->WhoSends(), mode);
 
-		JoinCounter *jc = c->ci->GetExt<JoinCounter>("joincounter");
+		JoinCounter *jc = joincounter.Get(c->ci);
 		if (jc)
 		{
 			jc->engaged = false;
@@ -149,6 +164,12 @@ class CommandCSSetJoinFlood : public Command
 				}
 			}
 
+			if (joins < 1 || joins > JoinCounter::MaxJoins)
+			{
+				source.Reply("The number of joins must be between 1 and %u.", JoinCounter::MaxJoins);
+				return;
+			}
+
 			Log(source.AccessFor(ci).HasPriv("SET") ? LOG_COMMAND : LOG_OVERRIDE, source, this, ci) << "to enable join flood protection";
 			ci->Extend<bool>("JOINFLOOD");
 			JoinCounter *jc = ci->Require<JoinCounter>("joincounter");
@@ -188,7 +209,7 @@ class CommandCSSetJoinFlood : public Command
 			" \n"
 			"The optional parameters to \002ON\002 are:\n"
 			" \n"
-			"joins: Number of joins to trigger protection\n"
+			"joins: Number of joins to trigger protection, from 1 to 32\n"
 			"secs: Number of seconds the joins must be within\n"
 			"duration: Number of seconds to restrict the channel\n");
 
@@ -227,13 +248,27 @@ class CSSetJoinFlood : public Module
 			if (s->GetSerializableType()->GetName() != "ChannelInfo")
 				return;
 
+			/* Unserialize is called for every channel, only those with JOINFLOOD get a counter */
 			ChannelInfo *ci = anope_dynamic_static_cast<ChannelInfo *>(s);
+			if (!this->HasExt(ci))
+			{
+				ci->Shrink<JoinCounter>("joincounter");
+				return;
+			}
+
 			JoinCounter *jc = ci->Require<JoinCounter>("joincounter");
 			if (jc)
 			{
 				data["jf:joins"] >> jc->joins;
 				data["jf:secs"] >> jc->secs;
 				data["jf:duration"] >> jc->duration;
+
+				/* Only the last MaxJoins joins are kept, older settings could be higher */
+				if (jc->joins > JoinCounter::MaxJoins)
+				{
+					Log() << "cs_set_joinflood: lowered the join limit of " << ci->name << " from " << jc->joins << " to " << JoinCounter::MaxJoins << " joins";
+					jc->joins = JoinCounter::MaxJoins;
+				}
 			}
 		}
 	} joinflood;
@@ -264,7 +299,7 @@ class CSSetJoinFlood : public Module
 			throw ModuleException("Requires version 2.0.x of Anope.");
 
 		this->SetAuthor("genius3000");
-		this->SetVersion("1.0.3");
+		this->SetVersion("1.0.4");
 
 		if (Me && Me->IsSynced())
 			this->Init();
@@ -279,14 +314,15 @@ class CSSetJoinFlood : public Module
 	{
 		if (Me && !Me->IsSynced())
 			return;
-		if (!joinflood.HasExt(c->ci))
-			return;
-		if (u->IsIdentified(true) || u->server->IsULined() || !u->server->IsSynced())
+		if (!c->ci)
 			return;
 
-		JoinCounter *jc = c->ci->GetExt<JoinCounter>("joincounter");
+		/* Only set while JOINFLOOD is (see ExtensibleUnserialize), so one lookup of the typed item covers both */
+		JoinCounter *jc = joincounter.Get(c->ci);
 		if (!jc)
 			return;
+		if (u->IsIdentified(true) || u->server->IsULined() || !u->server->IsSynced())
+			return;
 
 		/* If user is unregistered and joined while we are engaged, no channel mode was available.
 		 * We create a ban mask for them, add it to the ban list and kickban them.
@@ -304,27 +340,18 @@ class CSSetJoinFlood : public Module
 			return;
 		}
 
-		/* If we are due to reset, do that. Then increment counter by one for this join. */
-		if (jc->ShouldReset())
-		{
-			jc->ResetCounter();
-			jc->counter++;
-
-			return;
-		}
-
-		/* Increment counter for this join, check if we should engage or not. */
-		jc->counter++;
+		/* Add this join, check if the last 'joins' joins were within 'secs' seconds. */
+		jc->AddJoin();
 		if (!jc->ShouldEngage())
 			return;
 
-		/* Not due to reset and just hit the join counter limit; we engage, set mode (if available),
+		/* Just hit the join limit within the window; we engage, set mode (if available),
 		 * and set a Timer to disengage things after 'duration'.
 		 */
 		jc->engaged = true;
 		if (regonlymode)
 			c->SetMode(c->ci->WhoSends(), regonlymode);
-		new DisengageTimer(this, jc->duration, c, (regonlymode ? regonlymode->name : ""), symbol);
+		new DisengageTimer(this, jc->duration, c, (regonlymode ? regonlymode->name : ""), symbol, joincounter);
 		IRCD->SendNotice(c->ci->WhoSends(), (symbol ? Anope::string(symbol) : "") + c->name, "Join flood protection has engaged; lasting %lu seconds.", jc->duration);
 	}
 
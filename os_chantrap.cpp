@@ -10,7 +10,7 @@
  *
  * Syntax: CHANTRAP ADD mask botcount action duration modes reason
  *		    DEL {mask | entry-num | list}
- *		    LIST | VIEW [mask | entry-num | list]
+ *		    LIST | VIEW | STATS [mask | entry-num | list]
  *		    CLEAR
  *
  * Configuration to put into your operserv config:
@@ -18,12 +18,34 @@ module { name = "os_chantrap"; killreason = "I know what you did last join!"; ak
 command { service = "OperServ"; name = "CHANTRAP"; command = "operserv/chantrap"; permission = "operserv/chantrap"; }
  *
  * Don't forget to add 'operserv/chantrap' to your oper permissions
+ *
+ * Trapped users are killed at once. Their AKILLs are added at once too, or with
+ * 'akilldelay' set (e.g. 2s) in one batch after that long, each host only once.
+ * Users of hosts (or ranges) already AKILLed are left alone.
+ * If 'akillcidr' is set, that many hosts within the same /'akillcidrlen' (default 24)
+ * IPv4 or /'akillcidr6len' (default 64) IPv6 range get one AKILL for the whole range.
+ * Ranges are never wider than /16 for IPv4 or /32 for IPv6.
+ * The KILLs themselves can be limited to 'killrate' per second (default 0, no limit)
+ * with bursts of up to 'killburst' (default 50), users being AKILLed first.
+ *
+ * With 'createbots' enabled, 'botpool' (default 0) created bots are kept ready
+ * even when idle, any others quit after idling for 'botidle' (default 10m).
+ *
+ * On sync, active trap channels are created 'createrate' per second (default 10,
+ * 0 for all at once).
+ *
+ * STATS counts what each trap caught since start, 'keepstats' (default no) saves the
+ * totals with the traps. Unique hosts are only estimated over the last minute.
+ * A trap getting 'floodrate' (default 30, 0 for never) joins within a minute is
+ * logged as being flooded.
  */
 
 #include "module.h"
+#include <cmath>
 
 
 static ServiceReference<XLineManager> akills("XLineManager", "xlinemanager/sgline");
+static bool keep_stats = false;
 
 enum ChanTrapAction
 {
@@ -32,6 +54,98 @@ enum ChanTrapAction
 	CTA_SIZE
 };
 
+/* Hit counters of a Chan Trap, kept in memory ('keepstats' saves the totals) */
+struct ChanTrapStats
+{
+	/* Joins per 10 seconds for the last minute */
+	static const unsigned Slots = 6;
+	static const time_t SlotSecs = 10;
+
+	/* Hosts of each slot are hashed into a bitmap, the bits set within the last
+	 * minute give an estimate of its unique hosts (linear counting) in fixed memory.
+	 */
+	static const unsigned HostBits = 512;
+	static const unsigned HostWords = HostBits / 32;
+
+	unsigned long trapped;		/* Users caught */
+	unsigned long kills;
+	unsigned long akills;
+	time_t lasthit;
+	unsigned recent[Slots];
+	uint32_t hostbits[Slots][HostWords];
+	time_t slottime[Slots];		/* Start of the time slot counted in recent */
+	bool flooded;			/* Over 'floodrate' joins last minute, logged once */
+
+	ChanTrapStats() : trapped(0), kills(0), akills(0), lasthit(0), flooded(false)
+	{
+		for (unsigned i = 0; i < Slots; ++i)
+		{
+			recent[i] = 0;
+			slottime[i] = 0;
+			for (unsigned w = 0; w < HostWords; ++w)
+				hostbits[i][w] = 0;
+		}
+	}
+
+	/* KILLs and AKILLs are counted by the caller, as they are done */
+	void Hit(const User *u)
+	{
+		++trapped;
+		lasthit = Anope::CurTime;
+
+		const time_t now = Anope::CurTime - Anope::CurTime % SlotSecs;
+		const unsigned slot = (Anope::CurTime / SlotSecs) % Slots;
+		if (slottime[slot] != now)
+		{
+			slottime[slot] = now;
+			recent[slot] = 0;
+			for (unsigned w = 0; w < HostWords; ++w)
+				hostbits[slot][w] = 0;
+		}
+		++recent[slot];
+
+		const size_t bit = Anope::hash_ci()(u->host) % HostBits;
+		hostbits[slot][bit / 32] |= 1U << (bit % 32);
+	}
+
+	/* Estimated unique hosts within the last minute */
+	unsigned HostsLastMinute() const
+	{
+		uint32_t bits[HostWords] = { 0 };
+		for (unsigned i = 0; i < Slots; ++i)
+		{
+			if (slottime[i] + static_cast<time_t>(Slots) * SlotSecs <= Anope::CurTime)
+				continue;
+
+			for (unsigned w = 0; w < HostWords; ++w)
+				bits[w] |= hostbits[i][w];
+		}
+
+		unsigned zeros = 0;
+		for (unsigned w = 0; w < HostWords; ++w)
+			for (uint32_t v = ~bits[w]; v; v &= v - 1)
+				++zeros;
+
+		/* Every bit is set, the estimate is off the scale */
+		if (zeros == 0)
+			zeros = 1;
+
+		return static_cast<unsigned>(HostBits * std::log(static_cast<double>(HostBits) / zeros) + 0.5);
+	}
+
+	unsigned LastMinute() const
+	{
+		unsigned count = 0;
+		for (unsigned i = 0; i < Slots; ++i)
+		{
+			if (slottime[i] + static_cast<time_t>(Slots) * SlotSecs > Anope::CurTime)
+				count += recent[i];
+		}
+
+		return count;
+	}
+};
+
 /* Dataset for each Chan Trap */
 struct ChanTrapInfo : Serializable
 {
@@ -44,6 +158,7 @@ struct ChanTrapInfo : Serializable
 	Anope::string creator;	/* Nick of creator */
 	Anope::string reason;	/* Reason for this trap */
 	time_t created;		/* Time of creation */
+	mutable ChanTrapStats stats;	/* Updated through the const pointers the lookups give */
 
 	ChanTrapInfo() : Serializable("ChanTrap") { }
 
@@ -59,6 +174,14 @@ struct ChanTrapInfo : Serializable
 		data["creator"] << this->creator;
 		data["reason"] << this->reason;
 		data["created"] << this->created;
+
+		if (keep_stats)
+		{
+			data["trapped"] << this->stats.trapped;
+			data["kills"] << this->stats.kills;
+			data["akills"] << this->stats.akills;
+			data["lasthit"] << this->stats.lasthit;
+		}
 	}
 
 	static Serializable* Unserialize(Serializable *obj, Serialize::Data &data);
@@ -111,21 +234,97 @@ class CreatedBotInfo : public User
 	}
 };
 
-/* This class holds the list of created bots and any needed functions to this module */
+class BotRetireTimer : public Timer
+{
+ public:
+	BotRetireTimer(time_t secs) : Timer(secs) { }
+
+	void Tick(time_t) anope_override;
+};
+
+/* This class holds the list of created bots and any needed functions to this module.
+ * Bots are handed out least loaded first and are not quit as soon as they idle,
+ * 'botpool' of them are kept around and the rest quit after 'botidle'.
+ */
 class CreatedBots
 {
+	struct BotState
+	{
+		unsigned chans;	/* Channels joined */
+		time_t idle;	/* When the last channel was parted */
+
+		BotState() : chans(0), idle(Anope::CurTime) { }
+	};
+
+	typedef std::map<CreatedBotInfo *, BotState> bot_map;
+	typedef std::set<std::pair<unsigned, CreatedBotInfo *> > load_set;
+
  protected:
-	std::map<const CreatedBotInfo *, unsigned> Bots;
+	bot_map Bots;
+	load_set Load;			/* Bots ordered by channel count, least loaded first */
+	Anope::hash_map<CreatedBotInfo *> Nicks;
+	unsigned serial;		/* Number of the last nick handed out */
+
+	CreatedBotInfo *Create()
+	{
+		const unsigned nicklen = Config->GetBlock("networkinfo")->Get<unsigned>("nicklen");
+
+		/* CT1, CT2, ... skipping any nick already in use */
+		for (unsigned tries = 0; tries < 100; ++tries)
+		{
+			const Anope::string nick = "CT" + stringify(++serial);
+			if (nicklen && nick.length() > nicklen)
+				return NULL;
+			if (User::Find(nick, true))
+				continue;
+
+			CreatedBotInfo *cbi = new CreatedBotInfo(nick);
+			Bots.insert(std::make_pair(cbi, BotState()));
+			Load.insert(std::make_pair(0U, cbi));
+			Nicks[nick] = cbi;
+			return cbi;
+		}
+
+		return NULL;
+	}
+
+	void Destroy(CreatedBotInfo *cbi)
+	{
+		bot_map::iterator it = Bots.find(cbi);
+		if (it == Bots.end())
+			return;
+
+		Load.erase(std::make_pair(it->second.chans, cbi));
+		Nicks.erase(cbi->nick);
+		Bots.erase(it);
+		delete cbi;
+	}
+
+	void ScheduleRetire()
+	{
+		if (idletime == 0)
+			this->Retire();
+		else if (!timer)
+			timer = new BotRetireTimer(idletime);
+	}
 
  public:
-	CreatedBots() { }
+	BotRetireTimer *timer;	/* Set while idle bots are waiting to be retired */
+	unsigned pool;		/* Idle bots to keep */
+	time_t idletime;	/* Seconds before an idle bot beyond the pool quits */
+
+	CreatedBots() : serial(0), timer(NULL), pool(0), idletime(600) { }
 
 	~CreatedBots()
 	{
-		for (std::map<const CreatedBotInfo *, unsigned>::reverse_iterator it = Bots.rbegin(); it != Bots.rend(); ++it)
+		this->StopRetire();
+
+		for (bot_map::reverse_iterator it = Bots.rbegin(); it != Bots.rend(); ++it)
 			delete it->first;
 
 		Bots.clear();
+		Load.clear();
+		Nicks.clear();
 	}
 
 	const unsigned GetCount()
@@ -133,82 +332,429 @@ class CreatedBots
 		return Bots.size();
 	}
 
-	const CreatedBotInfo *Create()
+	const unsigned GetIdleCount()
 	{
-		const unsigned nicklen = Config->GetBlock("networkinfo")->Get<unsigned>("nicklen");
-		Anope::string nick;
+		unsigned count = 0;
+		for (load_set::const_iterator it = Load.begin(); it != Load.end() && it->first == 0; ++it)
+			++count;
+
+		return count;
+	}
 
-		unsigned tries = 0;
-		do
+	void Join(CreatedBotInfo *cbi, Channel *c)
+	{
+		bot_map::iterator it = Bots.find(cbi);
+		if (it == Bots.end() || c->FindUser(cbi))
+			return;
+
+		Load.erase(std::make_pair(it->second.chans, cbi));
+		cbi->Join(c);
+		++it->second.chans;
+		Load.insert(std::make_pair(it->second.chans, cbi));
+	}
+
+	/* Join 'count' bots to the channel, least loaded first, creating more as needed.
+	 * Returns how many were joined.
+	 */
+	unsigned Fill(Channel *c, unsigned count)
+	{
+		std::vector<CreatedBotInfo *> picked;
+		for (load_set::const_iterator it = Load.begin(); it != Load.end() && picked.size() < count; ++it)
 		{
-			nick = "CT" + stringify(static_cast<uint16_t>(rand()));
-			if (nick.length() > nicklen)
-				nick = nick.substr(0, nicklen);
+			if (!c->FindUser(it->second))
+				picked.push_back(it->second);
 		}
-		while (User::Find(nick) && tries++ < 10);
 
-		/* Should never get to this! */
-		if (tries == 11)
-			return NULL;
+		while (picked.size() < count)
+		{
+			CreatedBotInfo *cbi = this->Create();
+			if (!cbi)
+				break;
+
+			picked.push_back(cbi);
+		}
+
+		for (std::vector<CreatedBotInfo *>::const_iterator it = picked.begin(); it != picked.end(); ++it)
+			this->Join(*it, c);
+
+		return picked.size();
+	}
+
+	void Part(CreatedBotInfo *cbi, Channel *c)
+	{
+		bot_map::iterator it = Bots.find(cbi);
+		if (it == Bots.end() || !c->FindUser(cbi))
+			return;
+
+		Load.erase(std::make_pair(it->second.chans, cbi));
+		cbi->Part(c);
+		--it->second.chans;
+		Load.insert(std::make_pair(it->second.chans, cbi));
 
-		const CreatedBotInfo *cbi = new CreatedBotInfo(nick);
-		Bots.insert(std::make_pair(cbi, 0));
-		return cbi;
+		if (it->second.chans == 0)
+		{
+			it->second.idle = Anope::CurTime;
+			this->ScheduleRetire();
+		}
 	}
 
-	const std::map<const CreatedBotInfo *, unsigned> &GetBots()
+	void TryPart(const User *u, Channel *c)
 	{
-		return Bots;
+		Anope::hash_map<CreatedBotInfo *>::const_iterator it = Nicks.find(u->nick);
+		if (it != Nicks.end())
+			this->Part(it->second, c);
 	}
 
-	void Join(const CreatedBotInfo *cbi, Channel *c)
+	/* Create idle bots up to the pool size */
+	void Warm()
 	{
-		std::map<const CreatedBotInfo*, unsigned>::iterator it = Bots.find(cbi);
-		if (it != Bots.end())
+		for (unsigned idle = this->GetIdleCount(); idle < pool; ++idle)
 		{
-			const_cast<CreatedBotInfo *>(cbi)->Join(c);
-			++it->second;
+			if (!this->Create())
+				break;
 		}
 	}
 
-	void Part(const CreatedBotInfo *cbi, Channel *c)
+	/* Quit the bots beyond the pool that have idled long enough, longest idle first */
+	void Retire()
 	{
-		std::map<const CreatedBotInfo*, unsigned>::iterator it = Bots.find(cbi);
-		if (it == Bots.end())
+		std::vector<std::pair<time_t, CreatedBotInfo *> > idle;
+		for (load_set::const_iterator it = Load.begin(); it != Load.end() && it->first == 0; ++it)
+			idle.push_back(std::make_pair(Bots[it->second].idle, it->second));
+
+		if (idle.size() <= pool)
 			return;
 
-		const_cast<CreatedBotInfo *>(cbi)->Part(c);
-		if (--it->second == 0)
+		std::sort(idle.begin(), idle.end());
+
+		size_t excess = idle.size() - pool;
+		for (size_t i = 0; i < idle.size() && excess > 0; ++i, --excess)
 		{
-			delete (*it).first;
-			Bots.erase(it);
+			if (idle[i].first + idletime > Anope::CurTime)
+			{
+				/* The rest idled later, check back when this one is due */
+				if (!timer)
+					timer = new BotRetireTimer(idle[i].first + idletime - Anope::CurTime);
+				return;
+			}
+
+			this->Destroy(idle[i].second);
 		}
 	}
 
-	void TryPart(const User *u, Channel *c)
+	void StopRetire()
+	{
+		if (timer)
+		{
+			BotRetireTimer *t = timer;
+			timer = NULL;
+			delete t;
+		}
+	}
+}
+CreatedBots;
+
+void BotRetireTimer::Tick(time_t)
+{
+	/* This Timer is deleted once it returns */
+	CreatedBots.timer = NULL;
+	CreatedBots.Retire();
+}
+
+/* Index of Chan Traps by mask, so a join only checks the traps that can match:
+ * masks without wildcards are found with one hash lookup, wildcard masks hang off
+ * a trie of their longest run of literal characters, which a matching channel
+ * name must contain (so '#*spam*' is keyed on 'spam', not on the '#' every mask
+ * starts with), and regex masks are compiled only once.
+ */
+class ChanTrapIndex
+{
+	struct RunNode
+	{
+		std::map<char, RunNode *> children;
+		std::vector<ChanTrapInfo *> traps;
+
+		~RunNode()
+		{
+			for (std::map<char, RunNode *>::iterator it = children.begin(); it != children.end(); ++it)
+				delete it->second;
+		}
+	};
+
+	struct RegexTrap
+	{
+		ChanTrapInfo *ct;
+		Regex *regex;
+		bool compiled;	/* Compiling was tried, regex is NULL if it failed */
+	};
+
+	Anope::hash_map<std::vector<ChanTrapInfo *> > exact;
+	RunNode wildcards;
+	std::vector<RegexTrap> regexes;
+
+	static bool IsRegex(const Anope::string &mask)
+	{
+		return (mask.length() >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/');
+	}
+
+	/* The longest part of a wildcard mask without '*' or '?' */
+	static Anope::string LongestRun(const Anope::string &mask)
 	{
-		for (std::map<const CreatedBotInfo *, unsigned>::reverse_iterator it = Bots.rbegin(); it != Bots.rend(); ++it)
+		size_t best = 0, bestlen = 0;
+		for (size_t i = 0; i < mask.length(); )
 		{
-			const CreatedBotInfo *cbi = it->first;
+			size_t end = mask.find_first_of("*?", i);
+			if (end == Anope::string::npos)
+				end = mask.length();
 
-			if (cbi->nick == u->nick)
+			if (end - i > bestlen)
 			{
-				Part(cbi, c);
+				best = i;
+				bestlen = end - i;
+			}
+
+			i = end + 1;
+		}
+
+		return mask.substr(best, bestlen);
+	}
+
+	/* The trie nodes along a run, from the root, stopping early without 'create' */
+	void FindRun(const Anope::string &run, bool create, std::vector<RunNode *> &nodes)
+	{
+		RunNode *node = &wildcards;
+		nodes.push_back(node);
+
+		for (size_t i = 0; i < run.length(); ++i)
+		{
+			const char c = Anope::tolower(run[i]);
+			std::map<char, RunNode *>::iterator it = node->children.find(c);
+			if (it != node->children.end())
+				node = it->second;
+			else if (create)
+				node = node->children[c] = new RunNode();
+			else
+				return;
+
+			nodes.push_back(node);
+		}
+	}
+
+	static void Compile(RegexTrap &rt)
+	{
+		rt.compiled = true;
+
+		const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
+		ServiceReference<RegexProvider> provider("Regex", regexengine);
+		if (regexengine.empty() || !provider)
+			return;
+
+		try
+		{
+			rt.regex = provider->Compile(rt.ct->mask.substr(1, rt.ct->mask.length() - 2));
+		}
+		catch (const RegexException &ex)
+		{
+			Log(LOG_DEBUG) << "os_chantrap: " << ex.GetReason();
+		}
+	}
+
+	static bool Matches(RegexTrap &rt, const Anope::string &name)
+	{
+		if (!rt.compiled)
+			Compile(rt);
+
+		/* Without a regex engine this is how Anope::Match treats the mask */
+		if (!rt.regex)
+			return Anope::Match(name, rt.ct->mask, false, false);
+
+		return rt.regex->Matches(name);
+	}
+
+ public:
+	~ChanTrapIndex()
+	{
+		this->ReleaseRegexes();
+	}
+
+	void Add(ChanTrapInfo *ct)
+	{
+		if (IsRegex(ct->mask))
+		{
+			RegexTrap rt = { ct, NULL, false };
+			regexes.push_back(rt);
+		}
+		else if (ct->mask.find_first_of("*?") == Anope::string::npos)
+			exact[ct->mask].push_back(ct);
+		else
+		{
+			std::vector<RunNode *> nodes;
+			this->FindRun(LongestRun(ct->mask), true, nodes);
+			nodes.back()->traps.push_back(ct);
+		}
+	}
+
+	void Del(const ChanTrapInfo *ct)
+	{
+		if (IsRegex(ct->mask))
+		{
+			for (std::vector<RegexTrap>::iterator it = regexes.begin(); it != regexes.end(); ++it)
+			{
+				if (it->ct != ct)
+					continue;
+
+				delete it->regex;
+				regexes.erase(it);
 				return;
 			}
+
+			return;
+		}
+
+		if (ct->mask.find_first_of("*?") == Anope::string::npos)
+		{
+			Anope::hash_map<std::vector<ChanTrapInfo *> >::iterator it = exact.find(ct->mask);
+			if (it == exact.end())
+				return;
+
+			std::vector<ChanTrapInfo *>::iterator tit = std::find(it->second.begin(), it->second.end(), ct);
+			if (tit != it->second.end())
+				it->second.erase(tit);
+			if (it->second.empty())
+				exact.erase(it);
+
+			return;
+		}
+
+		const Anope::string run = LongestRun(ct->mask);
+		std::vector<RunNode *> nodes;
+		this->FindRun(run, false, nodes);
+		if (nodes.size() != run.length() + 1)
+			return;
+
+		std::vector<ChanTrapInfo *> &traps = nodes.back()->traps;
+		std::vector<ChanTrapInfo *>::iterator it = std::find(traps.begin(), traps.end(), ct);
+		if (it != traps.end())
+			traps.erase(it);
+
+		/* Prune the nodes left empty, deepest first */
+		for (size_t i = run.length(); i > 0; --i)
+		{
+			RunNode *node = nodes[i];
+			if (!node->traps.empty() || !node->children.empty())
+				break;
+
+			nodes[i - 1]->children.erase(Anope::tolower(run[i - 1]));
+			delete node;
 		}
 	}
-}
-CreatedBots;
+
+	void Clear()
+	{
+		this->ReleaseRegexes();
+		regexes.clear();
+		exact.clear();
+
+		for (std::map<char, RunNode *>::iterator it = wildcards.children.begin(); it != wildcards.children.end(); ++it)
+			delete it->second;
+		wildcards.children.clear();
+		wildcards.traps.clear();
+	}
+
+	/* Drop all compiled regexes (regex engine changed or is being unloaded) */
+	void ReleaseRegexes()
+	{
+		for (unsigned i = 0; i < regexes.size(); ++i)
+		{
+			delete regexes[i].regex;
+			regexes[i].regex = NULL;
+			regexes[i].compiled = false;
+		}
+	}
+
+	/* Check a single trap against a channel name, using the compiled regex if any */
+	bool Matches(const ChanTrapInfo *ct, const Anope::string &name)
+	{
+		if (!IsRegex(ct->mask))
+			return Anope::Match(name, ct->mask);
+
+		for (unsigned i = 0; i < regexes.size(); ++i)
+		{
+			if (regexes[i].ct == ct)
+				return Matches(regexes[i], name);
+		}
+
+		return Anope::Match(name, ct->mask, false, true);
+	}
+
+	/* All traps matching a channel name, in no particular order */
+	void GetMatches(const Anope::string &name, std::vector<ChanTrapInfo *> &matches)
+	{
+		Anope::hash_map<std::vector<ChanTrapInfo *> >::const_iterator eit = exact.find(name);
+		if (eit != exact.end())
+			matches.insert(matches.end(), eit->second.begin(), eit->second.end());
+
+		/* Walk the trie from each position of the name, every node reached is
+		 * a run the name contains. A trap can be reached more than once.
+		 */
+		std::vector<ChanTrapInfo *> candidates(wildcards.traps);
+		for (size_t start = 0; start < name.length(); ++start)
+		{
+			const RunNode *node = &wildcards;
+			for (size_t i = start; i < name.length(); ++i)
+			{
+				std::map<char, RunNode *>::const_iterator it = node->children.find(Anope::tolower(name[i]));
+				if (it == node->children.end())
+					break;
+
+				node = it->second;
+				candidates.insert(candidates.end(), node->traps.begin(), node->traps.end());
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		for (unsigned i = 0; i < candidates.size(); ++i)
+		{
+			if (Anope::Match(name, candidates[i]->mask))
+				matches.push_back(candidates[i]);
+		}
+
+		for (unsigned i = 0; i < regexes.size(); ++i)
+		{
+			if (Matches(regexes[i], name))
+				matches.push_back(regexes[i].ct);
+		}
+	}
+};
+
+/* The trap matching a Channel (or none), valid while the generation matches */
+struct ChanTrapCache
+{
+	unsigned generation;
+	const ChanTrapInfo *ct;
+
+	ChanTrapCache(Extensible *) : generation(0), ct(NULL) { }
+};
+
+/* Owned by the module, set while it is loaded */
+static ExtensibleItem<ChanTrapCache> *ChanTrapChannels = NULL;
 
 /* List of Chan Traps */
 class ChanTrapList
 {
  protected:
 	Serialize::Checker<std::vector<ChanTrapInfo *> > chantraps;
+	ChanTrapIndex index;
+	unsigned generation;	/* Bumped whenever the list changes, see ChanTrapCache */
 
  public:
-	ChanTrapList() : chantraps("ChanTrap") { }
+	ChanTrapList() : chantraps("ChanTrap"), generation(1) { }
+
+	unsigned GetGeneration() const
+	{
+		return generation;
+	}
 
 	~ChanTrapList()
 	{
@@ -219,6 +765,28 @@ class ChanTrapList
 	void Add(ChanTrapInfo *ct)
 	{
 		chantraps->push_back(ct);
+		index.Add(ct);
+		++generation;
+	}
+
+	/* Re-index all traps, after a trap's mask was changed in place */
+	void Reindex()
+	{
+		index.Clear();
+		for (unsigned i = 0; i < chantraps->size(); ++i)
+			index.Add(chantraps->at(i));
+		++generation;
+	}
+
+	void ReleaseRegexes()
+	{
+		index.ReleaseRegexes();
+		++generation;
+	}
+
+	bool Matches(const ChanTrapInfo *ct, const Anope::string &name)
+	{
+		return index.Matches(ct, name);
 	}
 
 	void Del(ChanTrapInfo *ct)
@@ -246,6 +814,9 @@ class ChanTrapList
 			}
 		}
 
+		index.Del(ct);
+		++generation;
+
 		std::vector<ChanTrapInfo *>::iterator it = std::find(chantraps->begin(), chantraps->end(), ct);
 		if (it != chantraps->end())
 			chantraps->erase(it);
@@ -257,131 +828,605 @@ class ChanTrapList
 			delete (*chantraps).at(i - 1);
 	}
 
-	const ChanTrapInfo *Find(const Anope::string &mask)
+	const ChanTrapInfo *Find(const Anope::string &mask)
+	{
+		std::vector<ChanTrapInfo *> matches;
+		index.GetMatches(mask, matches);
+
+		if (matches.empty())
+			return NULL;
+		if (matches.size() == 1)
+			return matches[0];
+
+		/* The first trap on the list wins, as it always has */
+		for (std::vector<ChanTrapInfo *>::const_iterator it = chantraps->begin(); it < chantraps->end(); ++it)
+		{
+			if (std::find(matches.begin(), matches.end(), *it) != matches.end())
+				return *it;
+		}
+
+		return NULL;
+	}
+
+	/* Find the trap of an existing Channel, only matching it again after the list changed */
+	const ChanTrapInfo *Find(Channel *c)
+	{
+		ChanTrapCache *cache = ChanTrapChannels ? ChanTrapChannels->Require(c) : NULL;
+		if (!cache)
+			return this->Find(c->name);
+
+		if (cache->generation != generation)
+		{
+			cache->ct = this->Find(c->name);
+			cache->generation = generation;
+		}
+
+		return cache->ct;
+	}
+
+	const ChanTrapInfo *FindExact(const Anope::string &mask)
+	{
+		for (std::vector<ChanTrapInfo *>::const_iterator it = chantraps->begin(); it < chantraps->end(); ++it)
+		{
+			const ChanTrapInfo *ct = *it;
+
+			if (ct->mask.equals_ci(mask))
+				return ct;
+		}
+
+		return NULL;
+	}
+
+	const ChanTrapInfo *Get(const unsigned number)
+	{
+		if (number >= chantraps->size())
+			return NULL;
+
+		return chantraps->at(number);
+	}
+
+	const unsigned GetCount()
+	{
+		return chantraps->size();
+	}
+
+	const std::vector<ChanTrapInfo *> &GetChanTraps()
+	{
+		return *chantraps;
+	}
+}
+ChanTrapList;
+
+ChanTrapInfo::~ChanTrapInfo()
+{
+	ChanTrapList.Del(this);
+}
+
+Serializable* ChanTrapInfo::Unserialize(Serializable *obj, Serialize::Data &data)
+{
+	ChanTrapInfo *ct;
+	Anope::string oldmask;
+
+	if (obj)
+	{
+		ct = anope_dynamic_static_cast<ChanTrapInfo *>(obj);
+		oldmask = ct->mask;
+	}
+	else
+		ct = new ChanTrapInfo;
+
+	data["mask"] >> ct->mask;
+	data["modes"] >> ct->modes;
+	data["bots"] >> ct->bots;
+	data["duration"] >> ct->duration;
+	data["creator"] >> ct->creator;
+	data["reason"] >> ct->reason;
+	data["created"] >> ct->created;
+	if (keep_stats)
+	{
+		data["trapped"] >> ct->stats.trapped;
+		data["kills"] >> ct->stats.kills;
+		data["akills"] >> ct->stats.akills;
+		data["lasthit"] >> ct->stats.lasthit;
+	}
+	unsigned int a;
+	data["action"] >> a;
+	ct->action = static_cast<ChanTrapAction>(a);
+
+	if (a > CTA_SIZE)
+		return NULL;
+
+	if (!obj)
+		ChanTrapList.Add(ct);
+	else if (ct->mask != oldmask)
+		ChanTrapList.Reindex();
+
+	return ct;
+}
+
+class ChanTrapDelCallback : public NumberList
+{
+	CommandSource &source;
+	unsigned deleted;
+	Command *cmd;
+
+ public:
+	ChanTrapDelCallback(CommandSource &_source, const Anope::string &numlist, Command *c) : NumberList(numlist, true), source(_source), deleted(0), cmd(c) { }
+
+	~ChanTrapDelCallback()
+	{
+		if (!deleted)
+		{
+			source.Reply("No matching entries on the Chan Trap list.");
+			return;
+		}
+
+		if (Anope::ReadOnly)
+			source.Reply(READ_ONLY_MODE);
+
+		if (deleted == 1)
+			source.Reply("Deleted 1 entry from the Chan Trap list.");
+		else
+			source.Reply("Deleted %d entries from the Chan Trap list.", deleted);
+	}
+
+	void HandleNumber(unsigned number) anope_override
+	{
+		if (!number)
+			return;
+
+		const ChanTrapInfo *ct = ChanTrapList.Get(number - 1);
+		if (!ct)
+			return;
+
+		Log(LOG_ADMIN, source, cmd) << "to remove " << ct->mask << " from the list";
+		++deleted;
+		delete ct;
+	}
+};
+
+/* Common functions */
+BotInfo *OperServ;
+Anope::string kill_reason;
+Anope::string akill_reason;
+unsigned flood_rate;
+
+/* The network of an address for a prefix length, as ip/len */
+static Anope::string GetNetwork(const sockaddrs &addr, unsigned len)
+{
+	sockaddrs net = addr;
+	unsigned char *bytes;
+	unsigned bits;
+
+	if (net.sa.sa_family == AF_INET)
+	{
+		bytes = reinterpret_cast<unsigned char *>(&net.sa4.sin_addr);
+		bits = 32;
+	}
+	else if (net.sa.sa_family == AF_INET6)
+	{
+		bytes = reinterpret_cast<unsigned char *>(&net.sa6.sin6_addr);
+		bits = 128;
+	}
+	else
+		return "";
+
+	if (len >= bits)
+		return net.addr();
+
+	unsigned i = len / 8;
+	if (len % 8)
+		bytes[i++] &= 0xFF << (8 - len % 8);
+	for (; i < bits / 8; ++i)
+		bytes[i] = 0;
+
+	return net.addr() + "/" + stringify(len);
+}
+
+/* Masks known to be on the AKILL list with their expiry, so the hosts of a flood
+ * are only looked up on the list once. Not every AKILL added is seen (only the
+ * ones added by us or through the XLine hooks), so a mask not found here is
+ * looked up on the list and remembered if it is there. It is rebuilt on sync and
+ * on each expire tick.
+ */
+class AkillCache
+{
+	Anope::hash_map<time_t> masks;
+
+ public:
+	void Rebuild()
+	{
+		masks.clear();
+		if (!akills)
+			return;
+
+		const std::vector<XLine *> &list = akills->GetList();
+		for (std::vector<XLine *>::const_iterator it = list.begin(); it != list.end(); ++it)
+			masks[(*it)->mask] = (*it)->expires;
+	}
+
+	bool Has(const Anope::string &mask)
+	{
+		if (!akills)
+			return false;
+
+		Anope::hash_map<time_t>::iterator it = masks.find(mask);
+		if (it != masks.end())
+		{
+			if (!it->second || it->second > Anope::CurTime)
+				return true;
+
+			masks.erase(it);
+		}
+
+		const XLine *x = akills->HasEntry(mask);
+		if (!x || (x->expires && x->expires <= Anope::CurTime))
+			return false;
+
+		masks[mask] = x->expires;
+		return true;
+	}
+
+	void Added(const Anope::string &mask, time_t expires)
+	{
+		masks[mask] = expires;
+	}
+
+	/* An AKILL is about to be deleted, keep its mask if another AKILL has it too */
+	void Removed(const XLine *x)
+	{
+		if (!akills)
+			return;
+
+		const std::vector<XLine *> &list = akills->GetList();
+		for (std::vector<XLine *>::const_iterator it = list.begin(); it != list.end(); ++it)
+		{
+			if (*it != x && (*it)->mask.equals_ci(x->mask))
+			{
+				masks[x->mask] = (*it)->expires;
+				return;
+			}
+		}
+
+		masks.erase(x->mask);
+	}
+
+	void Clear()
+	{
+		masks.clear();
+	}
+}
+AkillCache;
+
+class AkillFlushTimer : public Timer
+{
+ public:
+	AkillFlushTimer(time_t delay) : Timer(delay) { }
+
+	void Tick(time_t) anope_override;
+};
+
+/* Trap AKILLs waiting to be added. A join storm only adds each host once,
+ * in one batch, and dense ranges can be covered by a single CIDR AKILL.
+ */
+class PendingAkills
+{
+	struct Pending
+	{
+		Anope::string creator;
+		time_t expires;
+		sockaddrs ip;
+	};
+
+	Anope::hash_map<Pending> pending;	/* By AKILL mask */
+
+	bool AddAkill(const Anope::string &mask, const Pending &p)
+	{
+		if (AkillCache.Has(mask))
+			return false;
+
+		XLine *x = new XLine(mask, p.creator, p.expires, akill_reason, XLineManager::GenerateUID());
+		akills->AddXLine(x);
+		AkillCache.Added(mask, p.expires);
+		akills->Send(NULL, x);
+		return true;
+	}
+
+ public:
+	AkillFlushTimer *timer;		/* Set while a flush is due */
+	time_t delay;			/* How long AKILLs are held, 0 to add them at once */
+	unsigned cidr_threshold;	/* Hosts in one range before the range is AKILLed, 0 to never */
+	unsigned cidr_len, cidr6_len;	/* Size of those ranges */
+
+	PendingAkills() : timer(NULL), delay(0), cidr_threshold(0), cidr_len(24), cidr6_len(64) { }
+
+	enum AddResult
+	{
+		AKILL_QUEUED,	/* The host is queued */
+		AKILL_PENDING,	/* The host was queued already */
+		AKILL_EXISTS	/* The host, or a range AKILLed for it, is AKILLed already */
+	};
+
+	/* Queue an AKILL on the User's host */
+	AddResult Add(const User *u, const ChanTrapInfo *ct)
+	{
+		const Anope::string mask = "*@" + u->host;
+		const time_t expires = ct->duration + Anope::CurTime;
+
+		Anope::hash_map<Pending>::iterator it = pending.find(mask);
+		if (it != pending.end())
+		{
+			it->second.expires = std::max(it->second.expires, expires);
+			return AKILL_PENDING;
+		}
+
+		if (AkillCache.Has(mask))
+			return AKILL_EXISTS;
+
+		if (cidr_threshold)
+		{
+			const Anope::string net = GetNetwork(u->ip, u->ip.ipv6() ? cidr6_len : cidr_len);
+			if (!net.empty() && AkillCache.Has("*@" + net))
+				return AKILL_EXISTS;
+		}
+
+		Pending &p = pending[mask];
+		p.creator = ct->creator;
+		p.expires = expires;
+		p.ip = u->ip;
+
+		if (!delay)
+			this->Flush();
+		else if (!timer)
+			timer = new AkillFlushTimer(delay);
+		return AKILL_QUEUED;
+	}
+
+	void Flush()
+	{
+		if (timer)
+		{
+			AkillFlushTimer *t = timer;
+			timer = NULL;
+			delete t;
+		}
+
+		if (pending.empty())
+			return;
+
+		if (!akills)
+		{
+			pending.clear();
+			return;
+		}
+
+		const unsigned hosts = pending.size();
+		unsigned added = 0;
+
+		if (cidr_threshold)
+		{
+			std::map<Anope::string, std::vector<Anope::hash_map<Pending>::iterator> > ranges;
+			for (Anope::hash_map<Pending>::iterator it = pending.begin(); it != pending.end(); ++it)
+			{
+				const sockaddrs &ip = it->second.ip;
+				const Anope::string net = GetNetwork(ip, ip.ipv6() ? cidr6_len : cidr_len);
+				if (!net.empty())
+					ranges[net].push_back(it);
+			}
+
+			for (std::map<Anope::string, std::vector<Anope::hash_map<Pending>::iterator> >::iterator it = ranges.begin(); it != ranges.end(); ++it)
+			{
+				const std::vector<Anope::hash_map<Pending>::iterator> &members = it->second;
+				if (members.size() < cidr_threshold)
+					continue;
+
+				Pending merged = members[0]->second;
+				for (unsigned i = 0; i < members.size(); ++i)
+				{
+					merged.expires = std::max(merged.expires, members[i]->second.expires);
+					pending.erase(members[i]);
+				}
+
+				if (this->AddAkill("*@" + it->first, merged))
+					added++;
+			}
+		}
+
+		for (Anope::hash_map<Pending>::const_iterator it = pending.begin(); it != pending.end(); ++it)
+		{
+			if (this->AddAkill(it->first, it->second))
+				added++;
+		}
+		pending.clear();
+
+		if (added > 0)
+			Log(OperServ, "chantrap") << "Added " << added << " AKILL(s) for " << hosts << " trapped host(s)";
+	}
+}
+PendingAkills;
+
+void AkillFlushTimer::Tick(time_t)
+{
+	/* This Timer is deleted once it returns */
+	PendingAkills.timer = NULL;
+	PendingAkills.Flush();
+}
+
+class KillQueueTimer : public Timer
+{
+ public:
+	KillQueueTimer() : Timer(1) { }
+
+	void Tick(time_t) anope_override;
+};
+
+/* Outgoing trap KILLs, sent at no more than 'killrate' per second (with bursts
+ * of up to 'killburst') so a flood of trapped joins can't flood the uplink.
+ * Users being AKILLed go first, Users that already quit are skipped.
+ */
+class KillQueue
+{
+	std::deque<Anope::string> akilled, killed;	/* UIDs (or nicks) waiting */
+	std::set<Anope::string> queued;
+	unsigned tokens;
+	time_t last;		/* Last refill of the tokens */
+
+	/* Stats of the current backlog, logged once it is gone */
+	bool backlog;
+	unsigned long sent, dropped;
+	size_t peak;
+
+	void Refill()
+	{
+		if (Anope::CurTime > last)
+		{
+			tokens = std::min<unsigned long>(burst, tokens + (Anope::CurTime - last) * rate);
+			last = Anope::CurTime;
+		}
+	}
+
+	bool Send(const Anope::string &target, bool akill)
 	{
-		for (std::vector<ChanTrapInfo *>::const_iterator it = chantraps->begin(); it < chantraps->end(); ++it)
+		User *u = User::Find(target);
+		if (!u || u->Quitting())
 		{
-			const ChanTrapInfo *ct = *it;
-
-			if (Anope::Match(mask, ct->mask, false, true))
-				return ct;
+			++dropped;
+			return false;
 		}
 
-		return NULL;
+		u->Kill(OperServ, akill ? akill_reason : kill_reason);
+		++sent;
+		return true;
 	}
 
-	const ChanTrapInfo *FindExact(const Anope::string &mask)
+ public:
+	KillQueueTimer *timer;	/* Set while a backlog is being drained */
+	unsigned rate;		/* KILLs per second, 0 to not limit them */
+	unsigned burst;
+
+	KillQueue() : tokens(0), last(0), backlog(false), sent(0), dropped(0), peak(0), timer(NULL), rate(0), burst(0) { }
+
+	void Add(User *u, bool akill)
 	{
-		for (std::vector<ChanTrapInfo *>::const_iterator it = chantraps->begin(); it < chantraps->end(); ++it)
+		if (!rate)
 		{
-			const ChanTrapInfo *ct = *it;
+			u->Kill(OperServ, akill ? akill_reason : kill_reason);
+			return;
+		}
 
-			if (ct->mask.equals_ci(mask))
-				return ct;
+		const Anope::string &target = u->GetUID().empty() ? u->nick : u->GetUID();
+		if (!queued.insert(target).second)
+		{
+			++dropped;
+			return;
 		}
 
-		return NULL;
+		(akill ? akilled : killed).push_back(target);
+		peak = std::max(peak, queued.size());
+
+		this->Drain();
 	}
 
-	const ChanTrapInfo *Get(const unsigned number)
+	void Drain()
 	{
-		if (number >= chantraps->size())
-			return NULL;
+		this->Refill();
 
-		return chantraps->at(number);
+		while (tokens > 0 && !queued.empty())
+		{
+			const bool akill = !akilled.empty();
+			std::deque<Anope::string> &q = akill ? akilled : killed;
+			const Anope::string target = q.front();
+			q.pop_front();
+			queued.erase(target);
+
+			if (this->Send(target, akill))
+				--tokens;
+		}
+
+		if (!queued.empty())
+		{
+			backlog = true;
+			if (!timer)
+				timer = new KillQueueTimer();
+			return;
+		}
+
+		if (backlog)
+			Log(OperServ, "chantrap") << "KILL queue drained: " << sent << " sent, " << dropped << " dropped (quit or duplicate), peak depth " << peak;
+
+		backlog = false;
+		sent = dropped = peak = 0;
 	}
 
-	const unsigned GetCount()
+	/* Send everything that is left, used on unload */
+	void Flush()
 	{
-		return chantraps->size();
+		if (timer)
+		{
+			KillQueueTimer *t = timer;
+			timer = NULL;
+			delete t;
+		}
+
+		while (!akilled.empty())
+		{
+			this->Send(akilled.front(), true);
+			akilled.pop_front();
+		}
+
+		while (!killed.empty())
+		{
+			this->Send(killed.front(), false);
+			killed.pop_front();
+		}
+
+		queued.clear();
 	}
 
-	const std::vector<ChanTrapInfo *> &GetChanTraps()
+	void SetRate(unsigned newrate, unsigned newburst)
 	{
-		return *chantraps;
+		rate = newrate;
+		burst = std::max(newburst, 1U);
+		tokens = burst;
+		last = Anope::CurTime;
 	}
 }
-ChanTrapList;
-
-ChanTrapInfo::~ChanTrapInfo()
-{
-	ChanTrapList.Del(this);
-}
+KillQueue;
 
-Serializable* ChanTrapInfo::Unserialize(Serializable *obj, Serialize::Data &data)
+void KillQueueTimer::Tick(time_t)
 {
-	ChanTrapInfo *ct;
-
-	if (obj)
-		ct = anope_dynamic_static_cast<ChanTrapInfo *>(obj);
-	else
-		ct = new ChanTrapInfo;
-
-	data["mask"] >> ct->mask;
-	data["modes"] >> ct->modes;
-	data["bots"] >> ct->bots;
-	data["duration"] >> ct->duration;
-	data["creator"] >> ct->creator;
-	data["reason"] >> ct->reason;
-	data["created"] >> ct->created;
-	unsigned int a;
-	data["action"] >> a;
-	ct->action = static_cast<ChanTrapAction>(a);
-
-	if (a > CTA_SIZE)
-		return NULL;
-
-	if (!obj)
-		ChanTrapList.Add(ct);
-
-	return ct;
+	/* This Timer is deleted once it returns */
+	KillQueue.timer = NULL;
+	KillQueue.Drain();
 }
 
-class ChanTrapDelCallback : public NumberList
+/* Take the trap's action on a User, AKILLs are added with the next batch */
+void TrapUser(const ChanTrapInfo *ct, User *u)
 {
-	CommandSource &source;
-	unsigned deleted;
-	Command *cmd;
+	ct->stats.Hit(u);
 
- public:
-	ChanTrapDelCallback(CommandSource &_source, const Anope::string &numlist, Command *c) : NumberList(numlist, true), source(_source), deleted(0), cmd(c) { }
+	const unsigned rate = ct->stats.LastMinute();
+	if (flood_rate && rate >= flood_rate && !ct->stats.flooded)
+		Log(OperServ, "chantrap") << "Chan trap " << ct->mask << " is being flooded: " << rate << " joins in the last minute";
+	ct->stats.flooded = (flood_rate && rate >= flood_rate);
 
-	~ChanTrapDelCallback()
+	if (ct->action == CTA_KILL)
 	{
-		if (!deleted)
-		{
-			source.Reply("No matching entries on the Chan Trap list.");
-			return;
-		}
-
-		if (Anope::ReadOnly)
-			source.Reply(READ_ONLY_MODE);
-
-		if (deleted == 1)
-			source.Reply("Deleted 1 entry from the Chan Trap list.");
-		else
-			source.Reply("Deleted %d entries from the Chan Trap list.", deleted);
+		++ct->stats.kills;
+		KillQueue.Add(u, false);
 	}
-
-	void HandleNumber(unsigned number) anope_override
+	else if (ct->action == CTA_AKILL && akills)
 	{
-		if (!number)
-			return;
-
-		const ChanTrapInfo *ct = ChanTrapList.Get(number - 1);
-		if (!ct)
+		/* Users of AKILLed hosts are left to the AKILL, as they always were */
+		const PendingAkills::AddResult result = PendingAkills.Add(u, ct);
+		if (result == PendingAkills::AKILL_EXISTS)
 			return;
 
-		Log(LOG_ADMIN, source, cmd) << "to remove " << ct->mask << " from the list";
-		++deleted;
-		delete ct;
+		if (result == PendingAkills::AKILL_QUEUED)
+			++ct->stats.akills;
+		KillQueue.Add(u, true);
 	}
-};
-
-/* Common functions */
-BotInfo *OperServ;
-Anope::string kill_reason;
-Anope::string akill_reason;
+}
 
 void ApplyToChan(const ChanTrapInfo *ct, Channel *c)
 {
@@ -393,23 +1438,18 @@ void ApplyToChan(const ChanTrapInfo *ct, Channel *c)
 		if (u->HasMode("OPER") || (u->server && (u->server == Me || u->server->IsULined())))
 			continue;
 
-		if (ct->action == CTA_KILL)
-			u->Kill(OperServ, kill_reason);
-		else if (ct->action == CTA_AKILL && akills)
-		{
-			const Anope::string akillmask = "*@" + u->host;
-			if (akills->HasEntry(akillmask))
-				continue;
-
-			time_t expires = ct->duration + Anope::CurTime;
-
-			XLine *x = new XLine(akillmask, ct->creator, expires, akill_reason, XLineManager::GenerateUID());
-			akills->AddXLine(x);
-			akills->OnMatch(u, x);
-		}
+		TrapUser(ct, u);
 	}
 }
 
+struct BotLoadCompare
+{
+	bool operator()(const BotInfo *a, const BotInfo *b) const
+	{
+		return a->chans.size() < b->chans.size();
+	}
+};
+
 bool CreateChan(const ChanTrapInfo *ct)
 {
 	if (ct->bots == 0)
@@ -423,11 +1463,28 @@ bool CreateChan(const ChanTrapInfo *ct)
 	OperServ->Join(c, &status);
 	if (!created)
 	{
+		/* Simple modes the trap sets anyway are left alone, the rest
+		 * go out stacked with the trap's modes.
+		 */
+		Anope::string setting;
+		bool add = true;
+		for (size_t i = 0; i < ct->modes.length() && ct->modes[i] != ' '; ++i)
+		{
+			if (ct->modes[i] == '+' || ct->modes[i] == '-')
+				add = (ct->modes[i] == '+');
+			else if (add)
+				setting += ct->modes[i];
+		}
+
 		for (Channel::ModeList::const_iterator it = c->GetModes().begin(); it != c->GetModes().end(); )
 		{
 			const Anope::string mode = it->first, modearg = it->second;
 			++it;
 
+			ChannelMode *cm = ModeManager::FindChannelModeByName(mode);
+			if (cm && cm->type == MODE_REGULAR && setting.find(cm->mchar) != Anope::string::npos)
+				continue;
+
 			c->RemoveMode(OperServ, mode, modearg, false);
 		}
 	}
@@ -435,70 +1492,190 @@ bool CreateChan(const ChanTrapInfo *ct)
 	if (!created)
 		ApplyToChan(ct, c);
 
-	/* Join other bots up to the requested count */
+	/* Join the least loaded bots up to the requested count */
 	unsigned joined = 1;
-	for (botinfo_map::const_iterator it = BotListByNick->begin(), it_end = BotListByNick->end(); it != it_end; ++it)
+	if (ct->bots > joined)
 	{
-		if (joined == ct->bots)
-			return created;
+		std::vector<BotInfo *> bots;
+		for (botinfo_map::const_iterator it = BotListByNick->begin(), it_end = BotListByNick->end(); it != it_end; ++it)
+		{
+			BotInfo *bi = it->second;
+			if (bi && !bi->nick.equals_ci("OperServ"))
+				bots.push_back(bi);
+		}
 
-		BotInfo *bi = it->second;
-		if (!bi || bi->nick.equals_ci("OperServ"))
-			continue;
+		const size_t wanted = std::min<size_t>(ct->bots - joined, bots.size());
+		std::partial_sort(bots.begin(), bots.begin() + wanted, bots.end(), BotLoadCompare());
+		for (size_t i = 0; i < wanted; ++i)
+			bots[i]->Join(c, &status);
+		joined += wanted;
+	}
+
+	/* Then pooled bots, creating more to meet the requested count */
+	if (ct->bots > joined)
+		CreatedBots.Fill(c, ct->bots - joined);
+
+	return created;
+}
+
+/* Channels waiting to have their trap's action applied. A batch is done
+ * per pass of the event loop (woken through the Pipe), so matching every
+ * channel of a large network on sync doesn't stall services.
+ */
+class ChanTrapApplier : public Pipe
+{
+	std::deque<Anope::string> channels;
 
-		bi->Join(c, &status);
-		++joined;
+ public:
+	/* Channels done per pass of the event loop */
+	static const unsigned BatchSize = 100;
+
+	void Add(const Channel *c)
+	{
+		if (channels.empty())
+			this->Notify();
+
+		channels.push_back(c->name);
 	}
 
-	/* Join any already created bots */
-	if (ct->bots > joined && CreatedBots.GetCount() > 0)
+	void OnNotify() anope_override
 	{
-		const std::map<const CreatedBotInfo *, unsigned> &bots = CreatedBots.GetBots();
-		for (std::map<const CreatedBotInfo *, unsigned>::const_iterator it = bots.begin(), it_end = bots.end(); it != it_end; ++it)
+		for (unsigned i = 0; i < BatchSize && !channels.empty(); ++i)
 		{
-			if (joined == ct->bots)
-				return created;
+			Channel *c = Channel::Find(channels.front());
+			channels.pop_front();
 
-			const CreatedBotInfo *cbi = it->first;
-			if (cbi)
-			{
-				CreatedBots.Join(cbi, c);
-				++joined;
-			}
+			/* The trap could have been deleted in the meantime */
+			const ChanTrapInfo *ct = c ? ChanTrapList.Find(c) : NULL;
+			if (ct)
+				ApplyToChan(ct, c);
 		}
+
+		if (!channels.empty())
+			this->Notify();
 	}
+};
 
-	/* Create more bots to meet the requested count */
-	if (ct->bots > joined)
+/* Owned by the module, set while it is loaded */
+static ChanTrapApplier *ChanTrapApplying = NULL;
+
+class ChanTrapCreateTimer : public Timer
+{
+ public:
+	ChanTrapCreateTimer() : Timer(1) { }
+
+	void Tick(time_t) anope_override;
+};
+
+/* Active traps waiting for their channel to be created, 'createrate' per second
+ * (default 10, 0 for all at once) so that many of them don't add to the netburst.
+ */
+class PendingChannels
+{
+	std::deque<const ChanTrapInfo *> traps;
+	unsigned generation;	/* Of the Chan Trap list when the traps were queued */
+
+	/* Stats of the current run, logged once it is done */
+	unsigned created, matched;
+	time_t started;
+
+	/* Drop the traps that have been deleted since they were queued */
+	void Prune()
 	{
-		do
+		const std::vector<ChanTrapInfo *> &chantraps = ChanTrapList.GetChanTraps();
+		for (std::deque<const ChanTrapInfo *>::iterator it = traps.begin(); it != traps.end(); )
 		{
-			const CreatedBotInfo *cbi = CreatedBots.Create();
-			if (!cbi)
-				continue;
+			if (std::find(chantraps.begin(), chantraps.end(), *it) == chantraps.end())
+				it = traps.erase(it);
+			else
+				++it;
+		}
+
+		generation = ChanTrapList.GetGeneration();
+	}
 
-			CreatedBots.Join(cbi, c);
-			++joined;
+ public:
+	ChanTrapCreateTimer *timer;	/* Set while traps are waiting */
+	unsigned rate;
+
+	PendingChannels() : generation(0), created(0), matched(0), started(0), timer(NULL), rate(0) { }
+
+	void Add(const ChanTrapInfo *ct)
+	{
+		if (traps.empty())
+		{
+			generation = ChanTrapList.GetGeneration();
+			if (created == 0 && matched == 0)
+				started = Anope::CurTime;
 		}
-		while (joined < ct->bots);
+
+		traps.push_back(ct);
 	}
 
-	return created;
+	void Run()
+	{
+		if (generation != ChanTrapList.GetGeneration())
+			this->Prune();
+
+		for (unsigned i = 0; (!rate || i < rate) && !traps.empty(); ++i)
+		{
+			const ChanTrapInfo *ct = traps.front();
+			traps.pop_front();
+
+			if (CreateChan(ct))
+				created++;
+			else
+				matched++;
+		}
+
+		if (!traps.empty())
+		{
+			if (!timer)
+				timer = new ChanTrapCreateTimer();
+			return;
+		}
+
+		if (created > 0 || matched > 0)
+			Log(LOG_ADMIN, "ChanTrap Init", OperServ) << "Active chan trap(s) done in " << Anope::Duration(Anope::CurTime - started) << ": created " << created << " channel(s), took over " << matched << " channel(s).";
+
+		created = matched = 0;
+	}
+
+	void Clear()
+	{
+		if (timer)
+		{
+			ChanTrapCreateTimer *t = timer;
+			timer = NULL;
+			delete t;
+		}
+
+		traps.clear();
+		created = matched = 0;
+	}
+}
+PendingChannels;
+
+void ChanTrapCreateTimer::Tick(time_t)
+{
+	/* This Timer is deleted once it returns */
+	PendingChannels.timer = NULL;
+	PendingChannels.Run();
 }
 
+/* Queue the action on all channels matching a passive trap */
 const unsigned FindMatches(const ChanTrapInfo *ct)
 {
 	unsigned matches = 0;
 
-	for (channel_map::const_iterator it = ChannelList.begin(); it != ChannelList.end(); )
+	for (channel_map::const_iterator it = ChannelList.begin(); it != ChannelList.end(); ++it)
 	{
 		Channel *c = it->second;
-		++it;
 
-		if (Anope::Match(c->name, ct->mask, false, true))
+		if (ChanTrapList.Matches(ct, c->name))
 		{
 			matches++;
-			ApplyToChan(ct, c);
+			ChanTrapApplying->Add(c);
 		}
 	}
 
@@ -508,6 +1685,17 @@ const unsigned FindMatches(const ChanTrapInfo *ct)
 class CommandOSChanTrap : public Command
 {
  private:
+	static void FillStats(CommandSource &source, ListFormatter::ListEntry &entry, const ChanTrapInfo *ct)
+	{
+		entry["Trapped"] = stringify(ct->stats.trapped);
+		entry["Kills"] = stringify(ct->stats.kills);
+		entry["AKills"] = stringify(ct->stats.akills);
+		entry["Hosts/Min"] = stringify(ct->stats.HostsLastMinute());
+		const unsigned rate = ct->stats.LastMinute();
+		entry["Last Minute"] = stringify(rate) + (flood_rate && rate >= flood_rate ? " (flood)" : "");
+		entry["Last Hit"] = ct->stats.lasthit ? Anope::strftime(ct->stats.lasthit, source.nc, true) : "Never";
+	}
+
 	void DoAdd(CommandSource &source, const std::vector<Anope::string> &params)
 	{
 		Anope::string mask, saction, sduration, modes, reason;
@@ -690,7 +1878,7 @@ class CommandOSChanTrap : public Command
 		source.Reply("%s a Chan Trap on %s with %d bots and modes %s, action of %s", (created ? "Added" : "Modified"), mask.c_str(), bots, modes.c_str(), saction.c_str());
 
 		/* Non-active channel mask (can be multiple channels):
-		 * First find any matching active channels, FindMatches() will also Apply the action
+		 * First find any matching active channels, FindMatches() will also queue the action
 		 * Then find and drop any matching registered channels
 		 */
 		if (ct->bots == 0)
@@ -702,7 +1890,7 @@ class CommandOSChanTrap : public Command
 				ChannelInfo *ci = it->second;
 				++it;
 
-				if (!Anope::Match(ci->name, ct->mask, false, true))
+				if (!ChanTrapList.Matches(ct, ci->name))
 					continue;
 
 				dropped++;
@@ -818,6 +2006,7 @@ class CommandOSChanTrap : public Command
                                         entry["Action"] = saction;
                                         entry["Ban Duration"] = Anope::Duration(ct->duration, source.nc);
                                         entry["Reason"] = ct->reason;
+					FillStats(source, entry, ct);
 					list.AddEntry(entry);
 				}
 			}
@@ -852,6 +2041,7 @@ class CommandOSChanTrap : public Command
 					entry["Action"] = saction;
 					entry["Ban Duration"] = Anope::Duration(ct->duration, source.nc);
 					entry["Reason"] = ct->reason;
+					FillStats(source, entry, ct);
 					list.AddEntry(entry);
 				}
 			}
@@ -902,6 +2092,21 @@ class CommandOSChanTrap : public Command
 		this->ProcessList(source, params, list);
 	}
 
+	void DoStats(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (ChanTrapList.GetCount() == 0)
+		{
+			source.Reply("The chan trap list is empty.");
+			return;
+		}
+
+		ListFormatter list(source.GetAccount());
+		list.AddColumn("Number").AddColumn("Mask").AddColumn("Trapped").AddColumn("Kills").AddColumn("AKills");
+		list.AddColumn("Last Minute").AddColumn("Hosts/Min").AddColumn("Last Hit");
+
+		this->ProcessList(source, params, list);
+	}
+
 	void DoClear(CommandSource &source)
 	{
 		if (ChanTrapList.GetCount() == 0)
@@ -922,13 +2127,14 @@ class CommandOSChanTrap : public Command
 	void DoBotCount(CommandSource &source)
 	{
 		const unsigned count = CreatedBots.GetCount();
+		const unsigned idle = CreatedBots.GetIdleCount();
 
 		if (count == 0)
 			source.Reply("No bots are currently created by chan traps.");
 		else if (count == 1)
-			source.Reply("Currently there is 1 bot created by chan traps.");
+			source.Reply("Currently there is 1 bot created by chan traps (%u idle).", idle);
 		else
-			source.Reply("Currently there are %d bots created by chan traps.", count);
+			source.Reply("Currently there are %d bots created by chan traps (%u idle).", count, idle);
 
 	}
 
@@ -940,6 +2146,7 @@ class CommandOSChanTrap : public Command
 		this->SetSyntax("DEL {\037mask\037 | \037entry-num\037 | \037list\037}");
 		this->SetSyntax("LIST [\037mask\037 | \037entry-num\037 | \037list\037]");
 		this->SetSyntax("VIEW [\037mask\037 | \037entry-num\037 | \037list\037]");
+		this->SetSyntax("STATS [\037mask\037 | \037entry-num\037 | \037list\037]");
 		this->SetSyntax("CLEAR");
 		this->SetSyntax("BOTCOUNT");
 	}
@@ -956,6 +2163,8 @@ class CommandOSChanTrap : public Command
 			this->DoList(source, params);
 		else if (subcmd.equals_ci("VIEW"))
 			this->DoView(source, params);
+		else if (subcmd.equals_ci("STATS"))
+			this->DoStats(source, params);
 		else if (subcmd.equals_ci("CLEAR"))
 			this->DoClear(source);
 		else if (subcmd.equals_ci("BOTCOUNT"))
@@ -992,9 +2201,12 @@ class CommandOSChanTrap : public Command
 		}
 
 		source.Reply(" ");
-		source.Reply("The \002DEL\002, \002LIST\002, and \002VIEW\002 commands can be used with no parameters, with\n"
+		source.Reply("The \002DEL\002, \002LIST\002, \002VIEW\002, and \002STATS\002 commands can be used with no parameters, with\n"
 			     "a mask to match, an entry number, or a list of entry numbers (1-5 or 1,3 format).");
 		source.Reply(" ");
+		source.Reply("The \002STATS\002 command shows how many users each chan trap caught, and how many\n"
+			     "joined in the last minute from about how many unique hosts.");
+		source.Reply(" ");
 		source.Reply("The \002CLEAR\002 command clears all entries of the Chan Trap list.");
 		source.Reply(" ");
 		source.Reply("The \002BOTCOUNT\002 command shows how many bots have been created by chan traps.");
@@ -1016,59 +2228,117 @@ class CommandOSChanTrap : public Command
 class OSChanTrap : public Module
 {
 	Serialize::Type chantrapinfo_type;
+	ExtensibleItem<ChanTrapCache> chantrapcache;
 	CommandOSChanTrap commandoschantrap;
+	ChanTrapApplier applier;
 
 	void Init()
 	{
 		OperServ = Config->GetClient("OperServ");
+		AkillCache.Rebuild();
+		CreatedBots.Warm();
 
 		if (ChanTrapList.GetCount() == 0)
 			return;
 
 		unsigned matched_chans = 0;
-		unsigned created_chans = 0;
 
-		const std::vector<ChanTrapInfo *> &chantraps = ChanTrapList.GetChanTraps();
-		for (std::vector<ChanTrapInfo *>::const_iterator it = chantraps.begin(); it != chantraps.end(); ++it)
+		/* One pass over the channels for the passive traps, the first matching trap applies */
+		for (channel_map::const_iterator it = ChannelList.begin(); it != ChannelList.end(); ++it)
 		{
-			const ChanTrapInfo *ct = *it;
+			Channel *c = it->second;
 
-			if (ct->bots == 0)
-				matched_chans += FindMatches(ct);
-			else
+			const ChanTrapInfo *ct = ChanTrapList.Find(c);
+			if (ct && ct->bots == 0)
 			{
-				if (CreateChan(ct))
-					created_chans++;
-				else
-					matched_chans++;
+				applier.Add(c);
+				matched_chans++;
 			}
 		}
 
+		/* Active traps get their channels a few at a time */
+		const std::vector<ChanTrapInfo *> &chantraps = ChanTrapList.GetChanTraps();
+		for (std::vector<ChanTrapInfo *>::const_iterator it = chantraps.begin(); it != chantraps.end(); ++it)
+		{
+			if ((*it)->bots > 0)
+				PendingChannels.Add(*it);
+		}
+
 		if (matched_chans > 0)
 			Log(LOG_ADMIN, "ChanTrap Init", OperServ) << chantraps.size() << " chan trap(s) matched " << matched_chans << " channel(s).";
-		if (created_chans > 0)
-			Log(LOG_ADMIN, "ChanTrap Init", OperServ) << chantraps.size() << " chan trap(s) created " << created_chans << " channel(s).";
+
+		PendingChannels.Run();
 	}
 
  public:
 	OSChanTrap(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, THIRD),
-		chantrapinfo_type("ChanTrap", ChanTrapInfo::Unserialize), commandoschantrap(this)
+		chantrapinfo_type("ChanTrap", ChanTrapInfo::Unserialize), chantrapcache(this, "chantrap_cache"), commandoschantrap(this)
 	{
 		if (Anope::VersionMajor() != 2 || Anope::VersionMinor() != 0)
 			throw ModuleException("Requires version 2.0.x of Anope.");
 
+		ChanTrapChannels = &chantrapcache;
+		ChanTrapApplying = &applier;
+
 		this->SetAuthor("genius3000");
-		this->SetVersion("1.0.2");
+		this->SetVersion("1.1.0");
 
 		if (Me && Me->IsSynced())
 			this->Init();
 	}
 
+	~OSChanTrap()
+	{
+		PendingAkills.Flush();
+		KillQueue.Flush();
+		CreatedBots.StopRetire();
+		PendingChannels.Clear();
+		AkillCache.Clear();
+		ChanTrapChannels = NULL;
+		ChanTrapApplying = NULL;
+	}
+
 	void OnReload(Configuration::Conf *conf) anope_override
 	{
 		OperServ = conf->GetClient("OperServ");
 		kill_reason = conf->GetModule(this)->Get<Anope::string>("killreason", "I know what you did last join!");
 		akill_reason = conf->GetModule(this)->Get<Anope::string>("akillreason", "You found yourself a disappearing act!");
+		PendingAkills.delay = Anope::DoTime(conf->GetModule(this)->Get<const Anope::string>("akilldelay", "0"));
+		PendingAkills.cidr_threshold = conf->GetModule(this)->Get<unsigned>("akillcidr", "0");
+		PendingAkills.cidr_len = conf->GetModule(this)->Get<unsigned>("akillcidrlen", "24");
+		PendingAkills.cidr6_len = conf->GetModule(this)->Get<unsigned>("akillcidr6len", "64");
+
+		/* A typo here shouldn't AKILL a whole network, or everyone */
+		if (PendingAkills.cidr_len < 16)
+		{
+			Log() << "os_chantrap: akillcidrlen " << PendingAkills.cidr_len << " is too wide, using 16";
+			PendingAkills.cidr_len = 16;
+		}
+		if (PendingAkills.cidr6_len < 32)
+		{
+			Log() << "os_chantrap: akillcidr6len " << PendingAkills.cidr6_len << " is too wide, using 32";
+			PendingAkills.cidr6_len = 32;
+		}
+		KillQueue.SetRate(conf->GetModule(this)->Get<unsigned>("killrate", "0"), conf->GetModule(this)->Get<unsigned>("killburst", "50"));
+		PendingChannels.rate = conf->GetModule(this)->Get<unsigned>("createrate", "10");
+		keep_stats = conf->GetModule(this)->Get<bool>("keepstats", "no");
+		flood_rate = conf->GetModule(this)->Get<unsigned>("floodrate", "30");
+		CreatedBots.pool = conf->GetModule(this)->Get<bool>("createbots", "no") ? conf->GetModule(this)->Get<unsigned>("botpool", "0") : 0;
+		CreatedBots.idletime = Anope::DoTime(conf->GetModule(this)->Get<const Anope::string>("botidle", "10m"));
+		if (Me && Me->IsSynced())
+		{
+			CreatedBots.Warm();
+			CreatedBots.Retire();
+		}
+
+		/* The regex engine may have changed, recompile on next use */
+		ChanTrapList.ReleaseRegexes();
+	}
+
+	void OnModuleUnload(User *, Module *) anope_override
+	{
+		/* Compiled regexes belong to the regex engine module */
+		ChanTrapList.ReleaseRegexes();
 	}
 
 	void OnUplinkSync(Server *) anope_override
@@ -1076,12 +2346,17 @@ class OSChanTrap : public Module
 		this->Init();
 	}
 
+	void OnChannelCreate(Channel *c) anope_override
+	{
+		ChanTrapList.Find(c);
+	}
+
 	void OnJoinChannel(User *u, Channel *c) anope_override
 	{
 		if (u->server && (u->server == Me || u->server->IsULined()))
 			return;
 
-		const ChanTrapInfo *ct = ChanTrapList.Find(c->name);
+		const ChanTrapInfo *ct = ChanTrapList.Find(c);
 		if (!ct || (ct->action < 0 || ct->action >= CTA_SIZE))
 			return;
 
@@ -1095,19 +2370,18 @@ class OSChanTrap : public Module
 			return;
 		}
 
-		if (ct->action == CTA_KILL)
-			u->Kill(OperServ, kill_reason);
-		else if (ct->action == CTA_AKILL && akills)
-		{
-			const Anope::string akillmask = "*@" + u->host;
-			if (akills->HasEntry(akillmask))
-				return;
+		TrapUser(ct, u);
+	}
 
-			time_t expires = ct->duration + Anope::CurTime;
-			XLine *x = new XLine(akillmask, ct->creator, expires, akill_reason, XLineManager::GenerateUID());
-			akills->AddXLine(x);
-			akills->OnMatch(u, x);
-		}
+	void OnDelXLine(CommandSource &, const XLine *x, XLineManager *xlm) anope_override
+	{
+		if (xlm->name == "xlinemanager/sgline")
+			AkillCache.Removed(x);
+	}
+
+	void OnExpireTick() anope_override
+	{
+		AkillCache.Rebuild();
 	}
 
 	EventReturn OnPreCommand(CommandSource &source, Command *command, std::vector<Anope::string> &params) anope_override
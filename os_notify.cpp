@@ -17,9 +17,11 @@
  *		  LIST | VIEW | SHOW [mask | entry-num | list]
  *		  CLEAR
  *		  REMOVE nick
+ *		  STATS [mask | entry-num]
+ *		  IMPORT | EXPORT file[.notify]
  *
  * Configuration to put into your operserv config:
-module { name = "os_notify" }
+module { name = "os_notify"; initthreads = 4; logqueue = 512; foldtime = 5s; }
 command { service = "OperServ"; name = "NOTIFY"; command = "operserv/notify"; permission = "operserv/notify"; }
  *
  * Don't forget to add 'operserv/notify' to your oper permissions
@@ -30,582 +32,1966 @@ log { target = "#services-notify"; bot = "OperServ"; other = "notify/..."; }
  * notify/channel
  * notify/commands
  * Expiring entries follow the log format of: expire/notify
+ *
+ * 'initthreads' is the number of threads used to match all online users against
+ * the list when services sync (default 4). Small networks only use one.
+ * 'logqueue' is how many notifications can wait to be logged at the end of the
+ * current event loop pass (default 512), any more are dropped and counted.
+ * Set it to 0 to log every notification immediately.
+ * 'foldtime' is how long joins, parts and mode changes of a matched user are
+ * folded into one summary line after the first one is logged (default 5s).
+ * Set it to 0 to log every one of them.
+ * 'hideparams' is a space separated list of commands whose parameters are never
+ * logged, it defaults to:
+ * nickserv/register nickserv/identify nickserv/confirm nickserv/group nickserv/recover
+ * nickserv/set/password nickserv/cert memoserv/send memoserv/rsend memoserv/staff
  */
 
 #include "module.h"
+#include <fstream>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 
-/* Dataset for each Notify mask (entry) */
-struct NotifyEntry : Serializable
+/* A User's n!u@h#r (with the real host) for logging, only built for Users that
+ * are logged about. Dropped whenever the nick, ident or realname changes and
+ * once the User no longer matches any entry.
+ */
+struct NotifyUserStrings
 {
- public:
-	Anope::string mask;	/* Mask to match */
-	Anope::string reason;	/* Reason for this Notify */
-	std::set<char> flags;	/* Flags of what to track */
-	Anope::string creator;	/* Nick of creator */
-	time_t created;		/* Time of creation */
-	time_t expires;		/* Time of expiry */
+	Anope::string nuhr;
 
-	NotifyEntry() : Serializable("Notify") { }
+	NotifyUserStrings(Extensible *e)
+	{
+		const User *u = static_cast<User *>(e);
+		this->nuhr = u->nick + "!" + u->GetIdent() + "@" + u->host + "#" + u->realname;
+	}
+};
 
-	~NotifyEntry();
+/* Owned by the module, set while it is loaded */
+static ExtensibleItem<NotifyUserStrings> *NotifyStrings = NULL;
 
-	void Serialize(Serialize::Data &data) const anope_override
+static const NotifyUserStrings *GetUserStrings(const User *u)
+{
+	return NotifyStrings->Require(const_cast<User *>(u));
+}
+
+static const Anope::string &BuildNUHR(const User *u)
+{
+	static const Anope::string unknown = "unknown";
+	if (!u)
+		return unknown;
+
+	return GetUserStrings(u)->nuhr;
+}
+
+/* Copy of the parts of a User that masks are matched against.
+ * Being plain data, it can also be matched away from the main thread.
+ */
+struct NotifyTarget
+{
+	User *user;
+	Anope::string nick, ident, vident, host, displayed_host, cloaked_host, ip, realname;
+	sockaddrs addr;
+
+	NotifyTarget(User *u) : user(u), nick(u->nick), ident(u->GetIdent()), vident(u->GetVIdent()), host(u->host),
+		displayed_host(u->GetDisplayedHost()), cloaked_host(u->GetCloakedHost()), ip(u->ip.addr()), realname(u->realname), addr(u->ip) { }
+
+	/* u@h and n!u@h#r for regex masks, built the first time one is checked */
+	const Anope::string &GetUH() const
 	{
-		data["mask"] << this->mask;
-		data["reason"] << this->reason;
-		data["flags"] << Anope::string(this->flags.begin(), this->flags.end());
-		data["creator"] << this->creator;
-		data["created"] << this->created;
-		data["expires"] << this->expires;
+		if (this->uh.empty())
+			this->uh = this->ident + "@" + this->host;
+		return this->uh;
 	}
 
-	static Serializable* Unserialize(Serializable *obj, Serialize::Data &data);
-};
+	const Anope::string &GetNUHR() const
+	{
+		if (this->nuhr.empty())
+			this->nuhr = this->nick + "!" + this->GetUH() + "#" + this->realname;
+		return this->nuhr;
+	}
 
-/* Maps to track matched Notify Entries and Users */
-typedef std::multimap<const NotifyEntry *, const User *> PerEntryMap;
-typedef std::multimap<const User *, const NotifyEntry *> PerUserMap;
+ private:
+	mutable Anope::string uh, nuhr;
+};
 
-/* List of Notify Entries and currently Matched users */
-class NotifyList
+/* Compiled form of a Notify mask; built once whenever the mask is set
+ * so that matching never has to re-parse the mask or recompile a regex.
+ */
+class NotifyMatcher
 {
- protected:
-	Serialize::Checker<std::vector<NotifyEntry *> > notifies;
-	PerEntryMap match_entry;	/* Multiple Users mapped to one Notify Entry */
-	PerUserMap match_user;		/* Multiple Notify Entires mapped to one User */
+ public:
+	enum MaskType
+	{
+		NMT_USER,
+		NMT_CHANNEL,
+		NMT_REGEX_USER,
+		NMT_REGEX_CHANNEL
+	};
+
+ private:
+	MaskType type;
+	Anope::string nick, user, host, real;	/* Parsed parts of a user mask */
+	Anope::string channel;			/* Channel name of a channel mask */
+	cidr *range;				/* CIDR range of the host, if any */
+	unsigned short range_len;		/* Prefix length of the CIDR range */
+	Regex *regex;				/* Compiled regex of a regex mask */
+	Anope::string pattern;			/* Regex with the enclosing slashes stripped */
+
+	NotifyMatcher(const NotifyMatcher &);
+	NotifyMatcher &operator=(const NotifyMatcher &);
 
  public:
-	NotifyList() : notifies("Notify") { }
+	NotifyMatcher() : type(NMT_USER), range(NULL), range_len(0), regex(NULL) { }
 
-	~NotifyList()
+	~NotifyMatcher()
 	{
-		for (unsigned i = notifies->size(); i > 0; --i)
-			delete (*notifies).at(i - 1);
-
-		match_entry.clear();
-		match_user.clear();
+		this->Reset();
 	}
 
-	void AddNotify(NotifyEntry *ne)
+	void Reset()
 	{
-		notifies->push_back(ne);
+		delete this->range;
+		this->range = NULL;
+		this->range_len = 0;
+		delete this->regex;
+		this->regex = NULL;
+		this->nick.clear();
+		this->user.clear();
+		this->host.clear();
+		this->real.clear();
+		this->channel.clear();
+		this->pattern.clear();
 	}
 
-	void DelNotify(NotifyEntry *ne)
+	MaskType GetType() const
 	{
-		/* Erase all Map items matching to this Notify Entry */
-		match_entry.erase(ne);
-		for (PerUserMap::reverse_iterator rit = match_user.rbegin(); rit != match_user.rend(); )
-		{
-			if (rit->second == ne)
-				match_user.erase(--rit.base());
-			else
-				++rit;
-		}
+		return this->type;
+	}
 
-		/* Erase this Notify Entry from the Notify vector */
-		std::vector<NotifyEntry *>::iterator it = std::find(notifies->begin(), notifies->end(), ne);
-		if (it != notifies->end())
-			notifies->erase(it);
+	bool IsChannel() const
+	{
+		return (this->type == NMT_CHANNEL || this->type == NMT_REGEX_CHANNEL);
 	}
 
-	void ClearNotifies()
+	const Anope::string &GetHost() const
 	{
-		for (unsigned i = notifies->size(); i > 0; --i)
-			delete (*notifies).at(i - 1);
+		return this->host;
+	}
 
-		match_entry.clear();
-		match_user.clear();
+	const Anope::string &GetChannel() const
+	{
+		return this->channel;
 	}
 
-	void Expire(const NotifyEntry *ne)
+	/* Prefix length of the host's CIDR range, 0 if it is not a range */
+	unsigned short GetRangeLen() const
 	{
-		Log(Config->GetClient("OperServ"), "expire/notify") << "Expiring notify entry " << ne->mask;
-		delete ne;
+		return this->range ? this->range_len : 0;
 	}
 
-	const NotifyEntry *GetNotify(const unsigned number)
+	/* (Re)compile the regex of a regex mask, a failure leaves it uncompiled */
+	bool CompileRegex()
 	{
-		if (number >= notifies->size())
-			return NULL;
+		delete this->regex;
+		this->regex = NULL;
+
+		const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
+		if (regexengine.empty())
+			return false;
+
+		ServiceReference<RegexProvider> provider("Regex", regexengine);
+		if (!provider)
+			return false;
 
-		const NotifyEntry *ne = notifies->at(number);
-		if (ne->expires && ne->expires <= Anope::CurTime)
+		try
 		{
-			Expire(ne);
-			return NULL;
+			this->regex = provider->Compile(this->pattern);
+		}
+		catch (const RegexException &ex)
+		{
+			Log(LOG_DEBUG) << "os_notify: " << ex.GetReason();
+			return false;
 		}
 
-		return ne;
+		return true;
 	}
 
-	const NotifyEntry *GetNotify(const Anope::string &mask)
+	/* Compile the regex of a regex mask now, if it isn't already */
+	void Prepare()
 	{
-		for (unsigned i = notifies->size(); i > 0; --i)
-		{
-			const NotifyEntry *ne = notifies->at(i - 1);
-
-			if (ne->expires && ne->expires <= Anope::CurTime)
-				Expire(ne);
-			else if (ne->mask.equals_ci(mask))
-				return ne;
-		}
+		if ((this->type == NMT_REGEX_USER || this->type == NMT_REGEX_CHANNEL) && !this->regex)
+			this->CompileRegex();
+	}
 
-		return NULL;
+	/* Drop the compiled regex, it is recompiled on the next use */
+	void ReleaseRegex()
+	{
+		delete this->regex;
+		this->regex = NULL;
 	}
 
-	/* Check if a User matches to a mask */
-	bool Check(const User *u, const Anope::string &mask)
+	void Compile(const Anope::string &mask)
 	{
-		/* Regex mask: Matches against u@h and n!u@h#r only */
+		this->Reset();
+
+		/* Same rule as DoAdd: a '#' without a '@' is a channel mask */
+		const bool is_chan = (mask.find('#') != Anope::string::npos && mask.find('@') == Anope::string::npos);
+
 		if (mask.length() >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/')
 		{
-			const Anope::string uh = u->GetIdent() + '@' + u->host;
-			const Anope::string nuhr = u->nick + '!' + uh + '#' + u->realname;
-			return (Anope::Match(uh, mask, false, true) || Anope::Match(nuhr, mask, false, true));
+			this->type = is_chan ? NMT_REGEX_CHANNEL : NMT_REGEX_USER;
+			this->pattern = mask.substr(1, mask.length() - 2);
+			this->CompileRegex();
+			return;
 		}
 
-		/* Use 'modes' Entry to perform matching per item (nick, user, host, real) */
-		Entry notify_mask("", mask);
-		return notify_mask.Matches(const_cast<User *>(u), true);
-	}
-
-	/* Check if a Channel matches a mask */
-	bool Check(const Channel *c, const Anope::string &mask)
-	{
-		/* Regex mask */
-		if (mask.length() >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/')
+		if (is_chan)
 		{
-			return Anope::Match(c->name, mask, false, true);
+			this->type = NMT_CHANNEL;
+			this->channel = mask;
+			return;
 		}
 
-		return mask.equals_ci(c->name);
-	}
+		/* Use a 'modes' Entry to split the mask (nick, user, host, real, CIDR) */
+		this->type = NMT_USER;
+		Entry notify_mask("", mask);
+		this->nick = notify_mask.nick;
+		this->user = notify_mask.user;
+		this->host = notify_mask.host;
+		this->real = notify_mask.real;
 
-	const std::vector<NotifyEntry *> &GetNotifies()
-	{
-		for (unsigned i = notifies->size(); i > 0; --i)
+		if (notify_mask.cidr_len)
 		{
-			const NotifyEntry *ne = notifies->at(i - 1);
-			if (ne->expires && ne->expires <= Anope::CurTime)
-				Expire(ne);
+			try
+			{
+				this->range = new cidr(this->host, notify_mask.cidr_len);
+				this->range_len = notify_mask.cidr_len;
+			}
+			catch (const SocketException &)
+			{
+				this->range = NULL;
+			}
 		}
-
-		return *notifies;
 	}
 
-	const unsigned GetNotifiesCount()
+	/* Match a User, the same as a 'modes' Entry does with a full match */
+	bool Matches(const NotifyTarget &t)
 	{
-		return notifies->size();
+		if (this->type == NMT_REGEX_USER && !this->regex)
+			this->CompileRegex();
+
+		return this->MatchesCompiled(t);
 	}
 
-	/* Check if a User is already mapped to a specific Notify Entry */
-	bool ExistsAlready(const User *u, const NotifyEntry *ne)
+	/* As above, but never compiles a missing regex. This only reads the
+	 * matcher, so it is safe to use from threads while the list is unchanged.
+	 */
+	bool MatchesCompiled(const NotifyTarget &t) const
 	{
-		std::pair<PerUserMap::const_iterator, PerUserMap::const_iterator> itpair = match_user.equal_range(u);
-		for (PerUserMap::const_iterator it = itpair.first; it != itpair.second; ++it)
+		if (this->type == NMT_REGEX_USER)
+			return (this->regex && (this->regex->Matches(t.GetUH()) || this->regex->Matches(t.GetNUHR())));
+		else if (this->type != NMT_USER)
+			return false;
+
+		if (!this->nick.empty() && !Anope::Match(t.nick, this->nick))
+			return false;
+
+		if (!this->user.empty() && !Anope::Match(t.vident, this->user) && !Anope::Match(t.ident, this->user))
+			return false;
+
+		if (this->range)
 		{
-			if (it->second == ne)
-				return true;
+			if (!this->range->match(t.addr))
+				return false;
 		}
+		else if (!this->host.empty() && !Anope::Match(t.displayed_host, this->host) && !Anope::Match(t.cloaked_host, this->host) &&
+			 !Anope::Match(t.host, this->host) && !Anope::Match(t.ip, this->host))
+			return false;
 
-		return false;
+		if (!this->real.empty() && !Anope::Match(t.realname, this->real))
+			return false;
+
+		return true;
 	}
 
-	/* Map a User as matched to a specific Notify Entry */
-	void AddMatch(const User *u, const NotifyEntry *ne)
+	/* Match a Channel */
+	bool Matches(const Channel *c)
 	{
-		match_entry.insert(std::make_pair(ne, u));
-		match_user.insert(std::make_pair(u, ne));
+		if (this->type == NMT_CHANNEL)
+			return this->channel.equals_ci(c->name);
+		else if (this->type != NMT_REGEX_CHANNEL)
+			return false;
+
+		if (!this->regex && !this->CompileRegex())
+			return false;
+
+		return this->regex->Matches(c->name);
 	}
+};
 
-	/* Remove a User from the matched Maps */
-	void DelMatch(const User *u)
+/* Acceptable flags, in the order of their bits in NotifyFlag */
+static const Anope::string NotifyFlagChars = "Scdijkmnpstu";
+
+/* IMPORT and EXPORT files: their extension, the first line EXPORT writes,
+ * and how many invalid lines of an IMPORT are replied with
+ */
+static const Anope::string NotifyFileExt = ".notify";
+static const Anope::string NotifyFileHeader = "# os_notify export";
+static const unsigned MaxImportErrors = 10;
+
+/* Flags of what to track, stored as a bitmask */
+enum NotifyFlag
+{
+	NF_SETCOMMAND	= 1 << 0,	/* S = Services SET commands */
+	NF_CONNECT	= 1 << 1,	/* c = Connects */
+	NF_DISCONNECT	= 1 << 2,	/* d = Disconnects */
+	NF_INVITE	= 1 << 3,	/* i = channel Invites */
+	NF_JOIN		= 1 << 4,	/* j = channel Joins */
+	NF_KICK		= 1 << 5,	/* k = channel Kicks */
+	NF_CHANMODE	= 1 << 6,	/* m = channel Modes */
+	NF_NICK		= 1 << 7,	/* n = Nick changes */
+	NF_PART		= 1 << 8,	/* p = channel Parts */
+	NF_COMMAND	= 1 << 9,	/* s = Services commands (-SET) */
+	NF_TOPIC	= 1 << 10,	/* t = Topics */
+	NF_USERMODE	= 1 << 11	/* u = Usermodes */
+};
+
+static unsigned NotifyFlagsFromString(const Anope::string &str)
+{
+	unsigned flags = 0;
+	for (unsigned f = 0; f < str.length(); ++f)
 	{
-		match_user.erase(u);
-		for (PerEntryMap::reverse_iterator it = match_entry.rbegin(); it != match_entry.rend(); )
-		{
-			if (it->second == u)
-				match_entry.erase(--it.base());
-			else
-				++it;
-		}
+		size_t bit = NotifyFlagChars.find(str[f]);
+		if (bit != Anope::string::npos)
+			flags |= 1 << bit;
 	}
 
-	/* Check if a User is matched to any Notify Entries already */
-	bool IsMatch(const User *u)
+	return flags;
+}
+
+static Anope::string NotifyFlagsToString(unsigned flags)
+{
+	Anope::string str;
+	for (unsigned bit = 0; bit < NotifyFlagChars.length(); ++bit)
 	{
-		return (match_user.count(u) > 0);
+		if (flags & (1 << bit))
+			str.push_back(NotifyFlagChars[bit]);
 	}
 
-	/* Check if a User is matched to a Notify Entry with a specific flag */
-	bool HasFlag(const User *u, char flag)
-	{
-		std::pair<PerUserMap::const_iterator, PerUserMap::const_iterator> itpair = match_user.equal_range(u);
-		for (PerUserMap::const_iterator it = itpair.first; it != itpair.second; ++it)
-		{
-			if (it->second->flags.count(flag) > 0)
-				return true;
-		}
+	return str;
+}
 
-		return false;
-	}
+struct NotifyEntry;
+
+/* One User matched to one Notify Entry. Owned by the User's record and
+ * linked into the Entry's list of matched Users, so either side can be
+ * removed without searching the other.
+ */
+struct NotifyMatch
+{
+	NotifyEntry *entry;
+	User *user;
+	NotifyMatch *prev, *next;
+
+	NotifyMatch(NotifyEntry *ne, User *u);
+	~NotifyMatch();
+};
+
+/* Dataset for each Notify mask (entry) */
+struct NotifyEntry : Serializable
+{
+ public:
+	Anope::string mask;	/* Mask to match */
+	Anope::string reason;	/* Reason for this Notify */
+	unsigned flags;		/* Flags of what to track (NotifyFlag) */
+	Anope::string creator;	/* Nick of creator */
+	time_t created;		/* Time of creation */
+	time_t expires;		/* Time of expiry */
+	NotifyMatcher matcher;	/* Compiled form of the mask */
+	NotifyMatch *users;	/* Currently matched Users */
+
+	/* In memory only, see NOTIFY STATS */
+	unsigned long hits;	/* Times a User was matched */
+	unsigned long events;	/* Events of matched Users with one of our flags */
+	time_t lasthit;		/* Time of the last match or event */
+
+	NotifyEntry() : Serializable("Notify"), flags(0), users(NULL), hits(0), events(0), lasthit(0) { }
+
+	~NotifyEntry();
 
-	const PerEntryMap &GetEntryMap()
+	/* Set the mask, only recompiling the matcher if it has changed */
+	void SetMask(const Anope::string &newmask)
 	{
-		return match_entry;
+		if (newmask == this->mask)
+			return;
+
+		this->mask = newmask;
+		this->matcher.Compile(this->mask);
 	}
 
-	const PerUserMap &GetUserMap()
+	void Serialize(Serialize::Data &data) const anope_override
 	{
-		return match_user;
+		data["mask"] << this->mask;
+		data["reason"] << this->reason;
+		data["flags"] << NotifyFlagsToString(this->flags);
+		data["creator"] << this->creator;
+		data["created"] << this->created;
+		data["expires"] << this->expires;
 	}
-}
-NotifyList;
 
-NotifyEntry::~NotifyEntry()
+	static Serializable* Unserialize(Serializable *obj, Serialize::Data &data);
+};
+
+NotifyMatch::NotifyMatch(NotifyEntry *ne, User *u) : entry(ne), user(u), prev(NULL), next(ne->users)
 {
-	NotifyList.DelNotify(this);
+	if (this->next)
+		this->next->prev = this;
+	ne->users = this;
 }
 
-Serializable* NotifyEntry::Unserialize(Serializable *obj, Serialize::Data &data)
+NotifyMatch::~NotifyMatch()
 {
-	NotifyEntry *ne;
-
-	if (obj)
-		ne = anope_dynamic_static_cast<NotifyEntry *>(obj);
+	if (this->prev)
+		this->prev->next = this->next;
 	else
-		ne = new NotifyEntry();
-
-	Anope::string flags;
-	data["mask"] >> ne->mask;
-	data["reason"] >> ne->reason;
-	data["flags"] >> flags;
-	data["creator"] >> ne->creator;
-	data["created"] >> ne->created;
-	data["expires"] >> ne->expires;
-	for (unsigned f = 0; f != flags.length(); ++f)
-		ne->flags.insert(flags[f]);
+		this->entry->users = this->next;
 
-	if (!obj)
-		NotifyList.AddNotify(ne);
-
-	return ne;
+	if (this->next)
+		this->next->prev = this->prev;
 }
 
-/* Handle numbered (list) deletions */
-class NotifyDelCallback : public NumberList
+/* Notify Entries currently matched by a User, stored on the User */
+struct NotifyUserRecord
 {
-	CommandSource &source;
-	unsigned deleted;
-	Command *cmd;
+	static unsigned count;	/* Number of Users with a record */
 
- public:
-	NotifyDelCallback(CommandSource &_source, const Anope::string &numlist, Command *c) : NumberList(numlist, true), source(_source), deleted(0), cmd(c) { }
+	std::vector<NotifyMatch *> matches;
+	unsigned flags;		/* Union of the matched entries' flags */
 
-	~NotifyDelCallback()
+	NotifyUserRecord(Extensible *) : flags(0)
 	{
-		if (!deleted)
+		++count;
+	}
+
+	~NotifyUserRecord()
+	{
+		for (unsigned i = 0; i < matches.size(); ++i)
+			delete matches[i];
+
+		--count;
+	}
+
+	bool Has(const NotifyEntry *ne) const
+	{
+		for (unsigned i = 0; i < matches.size(); ++i)
 		{
-			source.Reply("No matching entries on the notify list.");
-			return;
+			if (matches[i]->entry == ne)
+				return true;
 		}
 
-		if (Anope::ReadOnly)
-			source.Reply(READ_ONLY_MODE);
-
-		if (deleted == 1)
-			source.Reply("Deleted 1 entry from the notify list.");
-		else
-			source.Reply("Deleted %d entries from the notify list.", deleted);
+		return false;
 	}
 
-	void HandleNumber(unsigned number) anope_override
+	/* Forget a match, without deleting it */
+	void Remove(const NotifyMatch *nm)
 	{
-		if (!number)
-			return;
+		for (unsigned i = 0; i < matches.size(); ++i)
+		{
+			if (matches[i] != nm)
+				continue;
 
-		const NotifyEntry *ne = NotifyList.GetNotify(number - 1);
-		if (!ne)
-			return;
+			matches[i] = matches.back();
+			matches.pop_back();
+			break;
+		}
 
-		Log(LOG_ADMIN, source, cmd) << "to remove " << ne->mask << " from the list";
-		delete ne;
-		++deleted;
+		this->UpdateFlags();
 	}
-};
 
-class CommandOSNotify : public Command
-{
- private:
-	void DoAdd(CommandSource &source, const std::vector<Anope::string> &params)
+	void UpdateFlags()
 	{
-		Anope::string expiry, str_flags, mask, reason;
+		this->flags = 0;
+		for (unsigned i = 0; i < matches.size(); ++i)
+			this->flags |= matches[i]->entry->flags;
+	}
+};
 
-		/* Expecting: ADD +expiry flags|* mask [:]reason
-		 * Ex:	ADD +30d cdjp idiot!moron@somewhere.com Annoying spammer
-		 * Ex:	ADD +30d * helper!help@*.isp.com#Here to help :Impersonating staff and spamming
-		 */
+unsigned NotifyUserRecord::count = 0;
 
-		if (params.size() < 4)
+/* Channel Notify Entries matching a Channel, stored on the Channel.
+ * Only valid while its generation matches the channel index's.
+ */
+struct NotifyChannelCache
+{
+	unsigned generation;
+	std::vector<NotifyEntry *> entries;
+
+	NotifyChannelCache(Extensible *) : generation(0) { }
+};
+
+/* Owned by the module, set while it is loaded */
+static ExtensibleItem<NotifyUserRecord> *NotifyRecords = NULL;
+static ExtensibleItem<NotifyChannelCache> *NotifyChannels = NULL;
+
+/* Index of user masks by their host part, so that a User is only checked
+ * against the masks that can possibly match it:
+ * - literal hosts/IPs in a case insensitive hash
+ * - CIDR masks in a binary radix tree (one per address family)
+ * - '*.literal.suffix' hosts in a trie of reversed host labels
+ * Anything else (wildcards, regex, no host) is left for a linear scan.
+ * Candidates are always confirmed by the entry's own matcher.
+ */
+class NotifyIndex
+{
+	struct CIDRNode
+	{
+		CIDRNode *child[2];
+		std::vector<NotifyEntry *> entries;
+
+		CIDRNode()
 		{
-			this->OnSyntaxError(source, "ADD");
-			return;
+			child[0] = child[1] = NULL;
 		}
 
-		expiry = params[1];
-		time_t expires = Anope::DoTime(expiry);
-		/* Like AKILL, default to days if not specified */
-		if (isdigit(expiry[expiry.length() - 1]))
-			expires *= 86400;
-		if (expires > 0)
-			expires += Anope::CurTime;
+		~CIDRNode()
+		{
+			delete child[0];
+			delete child[1];
+		}
+	};
 
-		/* Acceptable flags are:
-		 * c = Connects
-		 * d = Disconnects
-		 * i = channel Invites
-		 * j = channel Joins
-		 * k = channel Kicks
-		 * m = channel Modes
-		 * n = Nick changes
-		 * p = channel Parts
-		 * s = Services commands (-SET)
-		 * S = Services SET commands
-		 * t = Topics
-		 * u = Usermodes
-		 */
-		const Anope::string all_flags = "Scdijkmnpstu";
-		str_flags = params[2];
+	struct SuffixNode
+	{
+		Anope::hash_map<SuffixNode *> children;
+		std::vector<NotifyEntry *> entries;
 
-		if (str_flags == "*")
+		~SuffixNode()
 		{
-			str_flags = all_flags;
+			for (Anope::hash_map<SuffixNode *>::iterator it = children.begin(); it != children.end(); ++it)
+				delete it->second;
 		}
-		else if (str_flags.find_first_not_of(all_flags) != Anope::string::npos)
+	};
+
+	enum Bucket
+	{
+		NIB_NONE,
+		NIB_EXACT,
+		NIB_CIDR,
+		NIB_SUFFIX,
+		NIB_OTHER
+	};
+
+	Anope::hash_map<std::vector<NotifyEntry *> > exact;
+	CIDRNode *cidr4, *cidr6;
+	SuffixNode *suffixes;
+	std::vector<NotifyEntry *> others;
+
+	static Bucket Classify(const NotifyEntry *ne)
+	{
+		const NotifyMatcher &m = ne->matcher;
+
+		if (m.IsChannel())
+			return NIB_NONE;
+		if (m.GetType() != NotifyMatcher::NMT_USER)
+			return NIB_OTHER;
+		if (m.GetRangeLen())
+			return NIB_CIDR;
+
+		const Anope::string &host = m.GetHost();
+		if (host.empty())
+			return NIB_OTHER;
+		if (host.find_first_of("*?") == Anope::string::npos)
+			return NIB_EXACT;
+		if (host.length() > 2 && host[0] == '*' && host[1] == '.' && host.find_first_of("*?", 2) == Anope::string::npos)
+			return NIB_SUFFIX;
+
+		return NIB_OTHER;
+	}
+
+	static void Remove(std::vector<NotifyEntry *> &list, const NotifyEntry *ne)
+	{
+		std::vector<NotifyEntry *>::iterator it = std::find(list.begin(), list.end(), ne);
+		if (it != list.end())
+			list.erase(it);
+	}
+
+	/* Address bytes and length (in bits) of an IPv4 or IPv6 address */
+	static const unsigned char *GetBits(const sockaddrs &addr, unsigned &bits)
+	{
+		if (addr.sa.sa_family == AF_INET)
 		{
-			source.Reply("Incorrect flags character(s) given.");
-			return;
+			bits = 32;
+			return reinterpret_cast<const unsigned char *>(&addr.sa4.sin_addr);
+		}
+		else if (addr.sa.sa_family == AF_INET6)
+		{
+			bits = 128;
+			return reinterpret_cast<const unsigned char *>(&addr.sa6.sin6_addr);
 		}
 
-		std::set<char> flags;
-		for (unsigned f = 0; f < str_flags.length(); ++f)
-			flags.insert(str_flags[f]);
+		bits = 0;
+		return NULL;
+	}
 
-		spacesepstream sep(params[3]);
-		sep.GetToken(mask);
+	CIDRNode *FindCIDRNode(const NotifyEntry *ne, bool create)
+	{
+		const sockaddrs addr(ne->matcher.GetHost());
+		unsigned bits, len = ne->matcher.GetRangeLen();
+		const unsigned char *bytes = GetBits(addr, bits);
+		if (!bytes || len > bits)
+			return NULL;
 
-		if (sep.StreamEnd())
+		CIDRNode *node = (bits == 32 ? cidr4 : cidr6);
+		for (unsigned i = 0; node && i < len; ++i)
 		{
-			this->OnSyntaxError(source, "ADD");
-			return;
+			const unsigned bit = (bytes[i / 8] >> (7 - (i % 8))) & 1;
+			if (!node->child[bit] && create)
+				node->child[bit] = new CIDRNode();
+			node = node->child[bit];
 		}
 
-		size_t pound = mask.find('#');
-		size_t at = mask.find('@');
+		return node;
+	}
 
-		/* If '#' is after '@', we've got a real name */
-		if ((pound != Anope::string::npos && at != Anope::string::npos) && pound > at)
+	SuffixNode *FindSuffixNode(const NotifyEntry *ne, bool create)
+	{
+		/* Skip the leading '*.' */
+		const Anope::string &host = ne->matcher.GetHost();
+		std::vector<Anope::string> labels;
+		sepstream sep(host.substr(2), '.');
+		for (Anope::string label; sep.GetToken(label); )
+			labels.push_back(label);
+
+		SuffixNode *node = suffixes;
+		for (unsigned i = labels.size(); node && i > 0; --i)
 		{
-			const Anope::string remaining = sep.GetRemaining();
+			Anope::hash_map<SuffixNode *>::iterator it = node->children.find(labels[i - 1]);
+			if (it != node->children.end())
+				node = it->second;
+			else if (create)
+				node = node->children[labels[i - 1]] = new SuffixNode();
+			else
+				node = NULL;
+		}
 
-			size_t co = remaining[0] == ':' ? 0 : remaining.rfind(" :");
-			if (co == Anope::string::npos)
-			{
-				this->OnSyntaxError(source, "ADD");
-				return;
-			}
+		return node;
+	}
 
-			if (co != 0)
-				++co;
+	void FindCIDRs(const sockaddrs &addr, std::vector<NotifyEntry *> &candidates) const
+	{
+		unsigned bits;
+		const unsigned char *bytes = GetBits(addr, bits);
+		if (!bytes)
+			return;
 
-			reason = remaining.substr(co + 1);
-			mask += " " + remaining.substr(0, co);
-			mask.trim();
-		}
-		else
+		const CIDRNode *node = (bits == 32 ? cidr4 : cidr6);
+		for (unsigned i = 0; node; ++i)
 		{
-			reason = sep.GetRemaining();
+			candidates.insert(candidates.end(), node->entries.begin(), node->entries.end());
+			if (i == bits)
+				break;
+
+			node = node->child[(bytes[i / 8] >> (7 - (i % 8))) & 1];
 		}
+	}
 
-		if (mask.length() >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/')
+	/* Collect every suffix entry along the reversed labels of a host.
+	 * This may include a few too many (ex: '*.isp.com' for 'isp.com'),
+	 * the matcher confirms them afterwards.
+	 */
+	void FindSuffixes(const Anope::string &host, std::vector<NotifyEntry *> &candidates) const
+	{
+		const SuffixNode *node = suffixes;
+		size_t end = host.length();
+		while (node && end > 0)
 		{
-			const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
+			size_t dot = host.rfind('.', end - 1);
+			size_t start = (dot == Anope::string::npos ? 0 : dot + 1);
 
-			if (regexengine.empty())
+			if (start < end)
 			{
-				source.Reply("Regex is disabled.");
-				return;
+				Anope::hash_map<SuffixNode *>::const_iterator it = node->children.find(host.substr(start, end - start));
+				if (it == node->children.end())
+					return;
+
+				node = it->second;
+				candidates.insert(candidates.end(), node->entries.begin(), node->entries.end());
 			}
 
-			ServiceReference<RegexProvider> provider("Regex", regexengine);
-			if (!provider)
-			{
-				source.Reply("Unable to find regex engine %s.", regexengine.c_str());
+			if (dot == Anope::string::npos)
 				return;
+			end = dot;
+		}
+	}
+
+ public:
+	NotifyIndex() : cidr4(new CIDRNode()), cidr6(new CIDRNode()), suffixes(new SuffixNode()) { }
+
+	~NotifyIndex()
+	{
+		delete cidr4;
+		delete cidr6;
+		delete suffixes;
+	}
+
+	void Add(NotifyEntry *ne)
+	{
+		switch (Classify(ne))
+		{
+			case NIB_EXACT:
+				exact[ne->matcher.GetHost()].push_back(ne);
+				break;
+			case NIB_CIDR:
+			{
+				CIDRNode *node = FindCIDRNode(ne, true);
+				if (node)
+					node->entries.push_back(ne);
+				else
+					others.push_back(ne);
+				break;
 			}
+			case NIB_SUFFIX:
+				FindSuffixNode(ne, true)->entries.push_back(ne);
+				break;
+			case NIB_OTHER:
+				others.push_back(ne);
+				break;
+			case NIB_NONE:
+				break;
+		}
+	}
 
-			try
+	void Del(const NotifyEntry *ne)
+	{
+		switch (Classify(ne))
+		{
+			case NIB_EXACT:
 			{
-				Anope::string stripped_mask = mask.substr(1, mask.length() - 2);
-				delete provider->Compile(stripped_mask);
+				Anope::hash_map<std::vector<NotifyEntry *> >::iterator it = exact.find(ne->matcher.GetHost());
+				if (it != exact.end())
+				{
+					Remove(it->second, ne);
+					if (it->second.empty())
+						exact.erase(it);
+				}
+				break;
 			}
-			catch (const RegexException &ex)
+			case NIB_CIDR:
 			{
-				source.Reply("%s", ex.GetReason().c_str());
-				return;
+				CIDRNode *node = FindCIDRNode(ne, false);
+				if (node)
+					Remove(node->entries, ne);
+				else
+					Remove(others, ne);
+				break;
+			}
+			case NIB_SUFFIX:
+			{
+				SuffixNode *node = FindSuffixNode(ne, false);
+				if (node)
+					Remove(node->entries, ne);
+				break;
 			}
+			case NIB_OTHER:
+				Remove(others, ne);
+				break;
+			case NIB_NONE:
+				break;
 		}
+	}
 
-		if (mask.find_first_not_of("/~@.*?#") == Anope::string::npos)
-		{
-			source.Reply(USERHOST_MASK_TOO_WIDE, mask.c_str());
-			return;
-		}
+	/* Collect the (unique) user mask entries that can possibly match a User */
+	void GetCandidates(const NotifyTarget &t, std::vector<NotifyEntry *> &candidates) const
+	{
+		candidates.assign(others.begin(), others.end());
 
-		/* Valid masks either include a '@' or have '#' first (non-regex)
-		 * Regex chan matches just require '#' in the mask
-		 */
-		else if ((mask.find('@') == Anope::string::npos) &&
-			(mask[0] != '#') &&
-			(mask.length() < 2 || mask[0] != '/' || mask.find('#') == Anope::string::npos))
+		/* A user mask's host is matched against all of these */
+		const Anope::string *hosts[] = { &t.displayed_host, &t.cloaked_host, &t.host, &t.ip };
+		for (unsigned i = 0; i < 4; ++i)
 		{
-			source.Reply("Mask must be at least \037user\037@\037host\037 or have a \037#\037 for channel masks.");
-			return;
-		}
+			const Anope::string &host = *hosts[i];
+			if (host.empty())
+				continue;
 
-		NotifyEntry *ne = const_cast<NotifyEntry *>(NotifyList.GetNotify(mask));
-		bool created = true;
-		if (ne)
-		{
-			created = false;
-			delete ne;
-		}
-		ne = new NotifyEntry();
+			bool dupe = false;
+			for (unsigned j = 0; j < i && !dupe; ++j)
+				dupe = hosts[j]->equals_ci(host);
+			if (dupe)
+				continue;
 
-		ne->mask = mask;
-		ne->reason = reason;
-		ne->flags = flags;
-		ne->creator = source.GetNick();
-		ne->created = Anope::CurTime;
-		ne->expires = expires;
-		NotifyList.AddNotify(ne);
+			Anope::hash_map<std::vector<NotifyEntry *> >::const_iterator it = exact.find(host);
+			if (it != exact.end())
+				candidates.insert(candidates.end(), it->second.begin(), it->second.end());
 
-		if (Anope::ReadOnly)
-			source.Reply(READ_ONLY_MODE);
+			FindSuffixes(host, candidates);
+		}
 
-		unsigned matches = 0;
+		FindCIDRs(t.addr, candidates);
 
-		/* If mask contains '#' but not '@', it's a channel mask */
-		if (pound != Anope::string::npos && at == Anope::string::npos)
-		{
-			for (channel_map::const_iterator it = ChannelList.begin(); it != ChannelList.end(); ++it)
-			{
-				const Channel *c = it->second;
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	}
+};
 
-				if (!NotifyList.Check(c, ne->mask))
-					continue;
+/* Channel masks, kept apart from the user masks:
+ * exact names in a case insensitive hash and regexes in a short list.
+ * Each change bumps the generation, invalidating cached Channel results.
+ */
+class NotifyChannelIndex
+{
+	Anope::hash_map<std::vector<NotifyEntry *> > names;
+	std::vector<NotifyEntry *> regexes;
+	unsigned generation;
 
-				for (Channel::ChanUserList::const_iterator i = c->users.begin(); i != c->users.end(); ++i)
-				{
-					const User *u = i->first;
+	static void Remove(std::vector<NotifyEntry *> &list, const NotifyEntry *ne)
+	{
+		std::vector<NotifyEntry *>::iterator it = std::find(list.begin(), list.end(), ne);
+		if (it != list.end())
+			list.erase(it);
+	}
 
-					if (NotifyList.ExistsAlready(u, ne))
-						continue;
+ public:
+	NotifyChannelIndex() : generation(1) { }
 
-					NotifyList.AddMatch(u, ne);
-					matches++;
-				}
-			}
-		}
+	void Add(NotifyEntry *ne)
+	{
+		if (ne->matcher.GetType() == NotifyMatcher::NMT_CHANNEL)
+			names[ne->matcher.GetChannel()].push_back(ne);
+		else if (ne->matcher.GetType() == NotifyMatcher::NMT_REGEX_CHANNEL)
+			regexes.push_back(ne);
 		else
+			return;
+
+		this->Invalidate();
+	}
+
+	void Del(const NotifyEntry *ne)
+	{
+		if (ne->matcher.GetType() == NotifyMatcher::NMT_CHANNEL)
 		{
-			for (user_map::const_iterator it = UserListByNick.begin(); it != UserListByNick.end(); ++it)
+			Anope::hash_map<std::vector<NotifyEntry *> >::iterator it = names.find(ne->matcher.GetChannel());
+			if (it != names.end())
 			{
-				const User *u = it->second;
-
-				if (NotifyList.Check(u, ne->mask))
-				{
-					NotifyList.AddMatch(u, ne);
-					matches++;
-				}
+				Remove(it->second, ne);
+				if (it->second.empty())
+					names.erase(it);
 			}
 		}
+		else if (ne->matcher.GetType() == NotifyMatcher::NMT_REGEX_CHANNEL)
+			Remove(regexes, ne);
+		else
+			return;
 
-		Log(LOG_ADMIN, source, this) << "to " << (created ? "add" : "modify") << " a notify on " << mask << " for reason: " << reason << " (matches: " << matches << " user(s))";
-		source.Reply("%s a notify on %s which matched %d user(s).", (created ? "Added" : "Modified"), mask.c_str(), matches);
+		this->Invalidate();
 	}
 
-	void DoDel(CommandSource &source, const std::vector<Anope::string> &params)
+	void Invalidate()
 	{
-		const Anope::string &match = params.size() > 1 ? params[1] : "";
+		if (++generation == 0)
+			++generation;
+	}
 
-		if (match.empty())
-		{
-			this->OnSyntaxError(source, "DEL");
-			return;
-		}
+	/* Channel mask entries matching a Channel */
+	const std::vector<NotifyEntry *> &GetMatches(Channel *c)
+	{
+		static const std::vector<NotifyEntry *> none;
 
-		if (NotifyList.GetNotifiesCount() == 0)
+		/* Without regexes this is a single hash lookup, no need to cache */
+		if (regexes.empty())
 		{
-			source.Reply("The notify list is empty.");
-			return;
+			Anope::hash_map<std::vector<NotifyEntry *> >::const_iterator it = names.find(c->name);
+			return (it != names.end() ? it->second : none);
 		}
 
-		if (isdigit(match[0]) && match.find_first_not_of("1234567890,-") == Anope::string::npos)
-		{
-			NotifyDelCallback list(source, match, this);
-			list.Process();
-		}
-		else
-		{
-			const NotifyEntry *ne = NotifyList.GetNotify(match);
-			if (!ne)
-			{
-				source.Reply("\002%s\002 not found on the notify list.", match.c_str());
-				return;
-			}
+		NotifyChannelCache *cache = NotifyChannels->Require(c);
+		if (cache->generation == generation)
+			return cache->entries;
 
-			if (Anope::ReadOnly)
-				source.Reply(READ_ONLY_MODE);
+		cache->entries.clear();
+		Anope::hash_map<std::vector<NotifyEntry *> >::const_iterator it = names.find(c->name);
+		if (it != names.end())
+			cache->entries = it->second;
 
-			Log(LOG_ADMIN, source, this) << "to remove " << ne->mask << " from the list";
-			source.Reply("\002%s\002 deleted from the notify list.", ne->mask.c_str());
-			delete ne;
+		for (unsigned i = 0; i < regexes.size(); ++i)
+		{
+			if (regexes[i]->matcher.Matches(c))
+				cache->entries.push_back(regexes[i]);
 		}
+
+		cache->generation = generation;
+		return cache->entries;
 	}
+};
 
-	void ProcessList(CommandSource &source, const std::vector<Anope::string> &params, ListFormatter &list)
-	{
-		const Anope::string &match = params.size() > 1 ? params[1] : "";
+/* Expires Notify Entries as they become due, see NotifyList::ScheduleExpiry */
+class NotifyExpireTimer : public Timer
+{
+ public:
+	/* Longest time between ticks, used while nothing is due sooner */
+	static const time_t IdleSecs = 3600;
 
-		if (!match.empty() && isdigit(match[0]) && match.find_first_not_of("1234567890,-") == Anope::string::npos)
-		{
-			class ListCallback : public NumberList
-			{
-				CommandSource &source;
-				ListFormatter &list;
+	NotifyExpireTimer(Module *me) : Timer(me, IdleSecs, Anope::CurTime, true) { }
 
-			 public:
-				ListCallback(CommandSource &_source, ListFormatter &_list, const Anope::string &numstr) : NumberList(numstr, false), source(_source), list(_list) { }
+	void Tick(time_t) anope_override;
+};
 
-				void HandleNumber(unsigned number) anope_override
-				{
-					if (!number)
-						return;
+/* Owned by the module, set while it is loaded */
+static NotifyExpireTimer *NotifyExpiry = NULL;
 
-					const NotifyEntry *ne = NotifyList.GetNotify(number - 1);
-					if (!ne)
-						return;
+/* Kinds of masks that Check() latency is kept for */
+enum NotifyCheckKind
+{
+	NCK_PLAIN,
+	NCK_CIDR,
+	NCK_REGEX,
+	NCK_CHANNEL,
+	NCK_SIZE
+};
 
-					ListFormatter::ListEntry entry;
-					entry["Number"] = stringify(number);
-					entry["Mask"] = ne->mask;
-					entry["Flags"] = Anope::string(ne->flags.begin(), ne->flags.end());
-					entry["Reason"] = ne->reason;
-					entry["Created"] = Anope::strftime(ne->created, source.nc, true);
-					entry["By"] = ne->creator;
+static const char *const NotifyCheckKindNames[NCK_SIZE] = { "plain", "CIDR", "regex", "channel" };
+
+/* Histogram of Check() latency, see NOTIFY STATS.
+ * Only one in SampleRate checks is timed, to keep the clock off the hot paths.
+ */
+struct NotifyLatency
+{
+	/* Upper bounds of the buckets in microseconds, the last one is open */
+	static const unsigned Buckets = 6;
+	static const long Bounds[Buckets - 1];
+	static const unsigned SampleRate = 64;
+
+	unsigned long counts[Buckets];
+	unsigned long checks;
+	unsigned long timed;
+	unsigned long total;	/* Microseconds of the timed checks */
+
+	NotifyLatency() : checks(0), timed(0), total(0)
+	{
+		std::fill(counts, counts + Buckets, 0);
+	}
+
+	/* Count a check, true if it should be timed */
+	bool Sample()
+	{
+		return (checks++ % SampleRate) == 0;
+	}
+
+	void Add(long usecs)
+	{
+		/* The clock can step backwards */
+		if (usecs < 0)
+			usecs = 0;
+
+		unsigned i = 0;
+		while (i < Buckets - 1 && usecs >= Bounds[i])
+			++i;
+
+		++counts[i];
+		++timed;
+		total += usecs;
+	}
+};
+
+const long NotifyLatency::Bounds[NotifyLatency::Buckets - 1] = { 1, 10, 100, 1000, 10000 };
+
+/* List of Notify Entries and currently Matched users */
+class NotifyList
+{
+ protected:
+	Serialize::Checker<std::vector<NotifyEntry *> > notifies;
+	NotifyIndex index;		/* User mask entries indexed by host */
+	NotifyChannelIndex chanindex;	/* Channel mask entries */
+	std::vector<NotifyEntry *> expiries;	/* Min-heap of expiring entries */
+	NotifyLatency latency[NCK_SIZE];
+
+	static NotifyCheckKind GetCheckKind(const NotifyEntry *ne)
+	{
+		switch (ne->matcher.GetType())
+		{
+			case NotifyMatcher::NMT_USER:
+				return ne->matcher.GetRangeLen() ? NCK_CIDR : NCK_PLAIN;
+			case NotifyMatcher::NMT_CHANNEL:
+				return NCK_CHANNEL;
+			default:
+				return NCK_REGEX;
+		}
+	}
+
+	static void AddLatency(NotifyLatency &nl, const struct timeval &start)
+	{
+		struct timeval end;
+		gettimeofday(&end, NULL);
+		nl.Add((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec));
+	}
+
+	/* Heap order with the soonest expiry at the front */
+	static bool ExpiresLater(const NotifyEntry *a, const NotifyEntry *b)
+	{
+		return a->expires > b->expires;
+	}
+
+	void AddExpiry(NotifyEntry *ne)
+	{
+		if (!ne->expires)
+			return;
+
+		expiries.push_back(ne);
+		std::push_heap(expiries.begin(), expiries.end(), ExpiresLater);
+
+		if (expiries.front() == ne)
+			this->ScheduleExpiry();
+	}
+
+	void DelExpiry(const NotifyEntry *ne)
+	{
+		if (!expiries.empty() && expiries.front() == ne)
+		{
+			std::pop_heap(expiries.begin(), expiries.end(), ExpiresLater);
+			expiries.pop_back();
+			return;
+		}
+
+		std::vector<NotifyEntry *>::iterator it = std::find(expiries.begin(), expiries.end(), ne);
+		if (it == expiries.end())
+			return;
+
+		expiries.erase(it);
+		std::make_heap(expiries.begin(), expiries.end(), ExpiresLater);
+	}
+
+	void Expire(const NotifyEntry *ne)
+	{
+		Log(Config->GetClient("OperServ"), "expire/notify") << "Expiring notify entry " << ne->mask;
+		delete ne;
+	}
+
+ public:
+	NotifyList() : notifies("Notify") { }
+
+	~NotifyList()
+	{
+		for (unsigned i = notifies->size(); i > 0; --i)
+			delete (*notifies).at(i - 1);
+	}
+
+	void AddNotify(NotifyEntry *ne)
+	{
+		notifies->push_back(ne);
+		index.Add(ne);
+		chanindex.Add(ne);
+		this->AddExpiry(ne);
+	}
+
+	/* The expiry of a listed entry has changed */
+	void UpdateExpiry(NotifyEntry *ne)
+	{
+		this->DelExpiry(ne);
+		this->AddExpiry(ne);
+	}
+
+	/* Point the expiry timer at the soonest expiring entry */
+	void ScheduleExpiry()
+	{
+		if (!NotifyExpiry)
+			return;
+
+		time_t secs = NotifyExpireTimer::IdleSecs;
+		if (!expiries.empty() && expiries.front()->expires - Anope::CurTime < secs)
+			secs = std::max<time_t>(expiries.front()->expires - Anope::CurTime, 1);
+
+		NotifyExpiry->SetSecs(secs);
+	}
+
+	/* Expire all entries that are due, called by the expiry timer */
+	void ExpireDue()
+	{
+		while (!expiries.empty() && expiries.front()->expires <= Anope::CurTime)
+			this->Expire(expiries.front());
+
+		this->ScheduleExpiry();
+	}
+
+	/* Change the mask of a listed entry, keeping the index current */
+	void UpdateMask(NotifyEntry *ne, const Anope::string &mask)
+	{
+		if (mask == ne->mask)
+			return;
+
+		index.Del(ne);
+		chanindex.Del(ne);
+		ne->SetMask(mask);
+		index.Add(ne);
+		chanindex.Add(ne);
+	}
+
+	void DelNotify(NotifyEntry *ne)
+	{
+		/* Unmatch all Users matched to this Notify Entry */
+		while (ne->users)
+		{
+			NotifyMatch *nm = ne->users;
+			User *u = nm->user;
+
+			NotifyUserRecord *rec = NotifyRecords ? NotifyRecords->Get(u) : NULL;
+			if (rec)
+				rec->Remove(nm);
+			delete nm;
+
+			if (rec && rec->matches.empty())
+			{
+				NotifyRecords->Unset(u);
+				NotifyStrings->Unset(u);
+			}
+		}
+
+		index.Del(ne);
+		chanindex.Del(ne);
+		this->DelExpiry(ne);
+
+		/* Erase this Notify Entry from the Notify vector */
+		std::vector<NotifyEntry *>::iterator it = std::find(notifies->begin(), notifies->end(), ne);
+		if (it != notifies->end())
+			notifies->erase(it);
+	}
+
+	void ClearNotifies()
+	{
+		for (unsigned i = notifies->size(); i > 0; --i)
+			delete (*notifies).at(i - 1);
+	}
+
+	const NotifyEntry *GetNotify(const unsigned number)
+	{
+		if (number >= notifies->size())
+			return NULL;
+
+		return notifies->at(number);
+	}
+
+	const NotifyEntry *GetNotify(const Anope::string &mask)
+	{
+		for (unsigned i = notifies->size(); i > 0; --i)
+		{
+			const NotifyEntry *ne = notifies->at(i - 1);
+
+			if (ne->mask.equals_ci(mask))
+				return ne;
+		}
+
+		return NULL;
+	}
+
+	/* Check if a User matches to an entry's mask
+	 * Regex masks match against u@h and n!u@h#r only
+	 */
+	bool Check(const NotifyTarget &t, const NotifyEntry *ne)
+	{
+		NotifyLatency &nl = latency[GetCheckKind(ne)];
+		if (!nl.Sample())
+			return const_cast<NotifyEntry *>(ne)->matcher.Matches(t);
+
+		struct timeval start;
+		gettimeofday(&start, NULL);
+
+		const bool matched = const_cast<NotifyEntry *>(ne)->matcher.Matches(t);
+		AddLatency(nl, start);
+
+		return matched;
+	}
+
+	bool Check(User *u, const NotifyEntry *ne)
+	{
+		return this->Check(NotifyTarget(u), ne);
+	}
+
+	/* Check if a Channel matches an entry's mask */
+	bool Check(const Channel *c, const NotifyEntry *ne)
+	{
+		NotifyLatency &nl = latency[GetCheckKind(ne)];
+		if (!nl.Sample())
+			return const_cast<NotifyEntry *>(ne)->matcher.Matches(c);
+
+		struct timeval start;
+		gettimeofday(&start, NULL);
+
+		const bool matched = const_cast<NotifyEntry *>(ne)->matcher.Matches(c);
+		AddLatency(nl, start);
+
+		return matched;
+	}
+
+	const NotifyLatency &GetLatency(NotifyCheckKind kind) const
+	{
+		return latency[kind];
+	}
+
+	/* Drop all compiled regexes (regex engine changed or is being unloaded) */
+	void ReleaseRegexes()
+	{
+		for (unsigned i = 0; i < notifies->size(); ++i)
+			notifies->at(i)->matcher.ReleaseRegex();
+
+		chanindex.Invalidate();
+	}
+
+	/* Compile any regexes that aren't, before matching from threads */
+	void PrepareRegexes()
+	{
+		for (unsigned i = 0; i < notifies->size(); ++i)
+			notifies->at(i)->matcher.Prepare();
+	}
+
+	/* Live entries only, expired ones are removed by the expiry timer */
+	const std::vector<NotifyEntry *> &GetNotifies() const
+	{
+		return *notifies;
+	}
+
+	/* User mask entries that can possibly match a User, see NotifyIndex */
+	void GetCandidates(const NotifyTarget &t, std::vector<NotifyEntry *> &candidates) const
+	{
+		index.GetCandidates(t, candidates);
+	}
+
+	/* Channel mask entries matching a Channel, see NotifyChannelIndex */
+	const std::vector<NotifyEntry *> &GetChannelMatches(Channel *c)
+	{
+		return chanindex.GetMatches(c);
+	}
+
+	const unsigned GetNotifiesCount()
+	{
+		return notifies->size();
+	}
+
+	/* Check if a User is already mapped to a specific Notify Entry */
+	bool ExistsAlready(const User *u, const NotifyEntry *ne)
+	{
+		const NotifyUserRecord *rec = NotifyRecords->Get(u);
+		return (rec && rec->Has(ne));
+	}
+
+	/* Record a User as matched to a specific Notify Entry */
+	void AddMatch(const User *u, const NotifyEntry *ne)
+	{
+		User *user = const_cast<User *>(u);
+		NotifyUserRecord *rec = NotifyRecords->Require(user);
+		rec->matches.push_back(new NotifyMatch(const_cast<NotifyEntry *>(ne), user));
+		rec->flags |= ne->flags;
+
+		NotifyEntry *entry = const_cast<NotifyEntry *>(ne);
+		entry->hits++;
+		entry->lasthit = Anope::CurTime;
+	}
+
+	/* Remove a User from all matched Notify Entries */
+	void DelMatch(const User *u)
+	{
+		NotifyRecords->Unset(const_cast<User *>(u));
+		NotifyStrings->Unset(const_cast<User *>(u));
+	}
+
+	/* Remove a User from a single Notify Entry */
+	void DelMatch(const User *u, const NotifyEntry *ne)
+	{
+		NotifyUserRecord *rec = NotifyRecords->Get(u);
+		if (!rec)
+			return;
+
+		for (unsigned i = 0; i < rec->matches.size(); ++i)
+		{
+			NotifyMatch *nm = rec->matches[i];
+			if (nm->entry != ne)
+				continue;
+
+			rec->Remove(nm);
+			delete nm;
+			break;
+		}
+
+		if (rec->matches.empty())
+		{
+			NotifyRecords->Unset(const_cast<User *>(u));
+			NotifyStrings->Unset(const_cast<User *>(u));
+		}
+	}
+
+	/* Check if a User is matched to any Notify Entries already */
+	bool IsMatch(const User *u)
+	{
+		return NotifyRecords->HasExt(u);
+	}
+
+	/* Check if a User is matched to a Notify Entry with a specific flag */
+	bool HasFlag(const User *u, NotifyFlag flag)
+	{
+		/* Nobody is matched, the usual case */
+		if (!NotifyUserRecord::count)
+			return false;
+
+		const NotifyUserRecord *rec = NotifyRecords->Get(u);
+		return (rec && (rec->flags & flag));
+	}
+
+	/* HasFlag() for an event about to be logged, counting it for the
+	 * matched entries that have the flag.
+	 */
+	bool WantsEvent(const User *u, NotifyFlag flag)
+	{
+		if (!this->HasFlag(u, flag))
+			return false;
+
+		const NotifyUserRecord *rec = NotifyRecords->Get(u);
+		for (unsigned i = 0; i < rec->matches.size(); ++i)
+		{
+			NotifyEntry *ne = rec->matches[i]->entry;
+			if (!(ne->flags & flag))
+				continue;
+
+			ne->events++;
+			ne->lasthit = Anope::CurTime;
+		}
+
+		return true;
+	}
+
+	/* Check if any Users are currently matched */
+	bool HasMatches()
+	{
+		for (unsigned i = 0; i < notifies->size(); ++i)
+		{
+			if (notifies->at(i)->users)
+				return true;
+		}
+
+		return false;
+	}
+}
+NotifyList;
+
+NotifyEntry::~NotifyEntry()
+{
+	NotifyList.DelNotify(this);
+}
+
+void NotifyExpireTimer::Tick(time_t)
+{
+	NotifyList.ExpireDue();
+}
+
+Serializable* NotifyEntry::Unserialize(Serializable *obj, Serialize::Data &data)
+{
+	NotifyEntry *ne;
+
+	if (obj)
+		ne = anope_dynamic_static_cast<NotifyEntry *>(obj);
+	else
+		ne = new NotifyEntry();
+
+	Anope::string mask, flags;
+	data["mask"] >> mask;
+	if (obj)
+		NotifyList.UpdateMask(ne, mask);
+	else
+		ne->SetMask(mask);
+	data["reason"] >> ne->reason;
+	data["flags"] >> flags;
+	data["creator"] >> ne->creator;
+	data["created"] >> ne->created;
+	time_t expires = ne->expires;
+	data["expires"] >> ne->expires;
+	const unsigned oldflags = ne->flags;
+	ne->flags = NotifyFlagsFromString(flags);
+
+	/* Users already matched keep the union of their entries' flags */
+	if (obj && ne->flags != oldflags && NotifyRecords)
+	{
+		for (const NotifyMatch *nm = ne->users; nm; nm = nm->next)
+		{
+			NotifyUserRecord *record = NotifyRecords->Get(nm->user);
+			if (record)
+				record->UpdateFlags();
+		}
+	}
+
+	if (!obj)
+		NotifyList.AddNotify(ne);
+	else if (ne->expires != expires)
+		NotifyList.UpdateExpiry(ne);
+
+	return ne;
+}
+
+/* Handle numbered (list) deletions */
+class NotifyDelCallback : public NumberList
+{
+	CommandSource &source;
+	unsigned deleted;
+	Command *cmd;
+
+ public:
+	NotifyDelCallback(CommandSource &_source, const Anope::string &numlist, Command *c) : NumberList(numlist, true), source(_source), deleted(0), cmd(c) { }
+
+	~NotifyDelCallback()
+	{
+		if (!deleted)
+		{
+			source.Reply("No matching entries on the notify list.");
+			return;
+		}
+
+		if (Anope::ReadOnly)
+			source.Reply(READ_ONLY_MODE);
+
+		if (deleted == 1)
+			source.Reply("Deleted 1 entry from the notify list.");
+		else
+			source.Reply("Deleted %d entries from the notify list.", deleted);
+	}
+
+	void HandleNumber(unsigned number) anope_override
+	{
+		if (!number)
+			return;
+
+		const NotifyEntry *ne = NotifyList.GetNotify(number - 1);
+		if (!ne)
+			return;
+
+		Log(LOG_ADMIN, source, cmd) << "to remove " << ne->mask << " from the list";
+		delete ne;
+		++deleted;
+	}
+};
+
+class CommandOSNotify : public Command
+{
+ private:
+	/* Check that a mask is usable, giving the reason if it is not */
+	bool ValidateMask(CommandSource &source, const Anope::string &mask, Anope::string &error)
+	{
+		if (mask.length() >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/')
+		{
+			const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
+
+			if (regexengine.empty())
+			{
+				error = "Regex is disabled.";
+				return false;
+			}
+
+			ServiceReference<RegexProvider> provider("Regex", regexengine);
+			if (!provider)
+			{
+				error = "Unable to find regex engine " + regexengine + ".";
+				return false;
+			}
+
+			try
+			{
+				Anope::string stripped_mask = mask.substr(1, mask.length() - 2);
+				delete provider->Compile(stripped_mask);
+			}
+			catch (const RegexException &ex)
+			{
+				error = ex.GetReason();
+				return false;
+			}
+		}
+
+		if (mask.find_first_not_of("/~@.*?#") == Anope::string::npos)
+		{
+			error = Anope::printf(Language::Translate(source.GetAccount(), USERHOST_MASK_TOO_WIDE), mask.c_str());
+			return false;
+		}
+
+		/* Valid masks either include a '@' or have '#' first (non-regex)
+		 * Regex chan matches just require '#' in the mask
+		 */
+		else if ((mask.find('@') == Anope::string::npos) &&
+			(mask[0] != '#') &&
+			(mask.length() < 2 || mask[0] != '/' || mask.find('#') == Anope::string::npos))
+		{
+			error = "Mask must be at least \037user\037@\037host\037 or have a \037#\037 for channel masks.";
+			return false;
+		}
+
+		return true;
+	}
+
+	/* Notify list files are kept in the data directory, never outside of it, and always
+	 * end in .notify so no other file there (like the databases) can be read or written.
+	 */
+	bool GetListFile(CommandSource &source, Anope::string &name, Anope::string &path)
+	{
+		if (name.empty() || name[0] == '.' || name.find_first_of("/\\") != Anope::string::npos)
+		{
+			source.Reply("Invalid file name \002%s\002.", name.c_str());
+			return false;
+		}
+
+		if (name.length() < NotifyFileExt.length() || !name.substr(name.length() - NotifyFileExt.length()).equals_ci(NotifyFileExt))
+			name += NotifyFileExt;
+
+		path = Anope::Expand(Anope::DataDir, name);
+		return true;
+	}
+
+	void DoAdd(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		Anope::string expiry, str_flags, mask, reason;
+
+		/* Expecting: ADD +expiry flags|* mask [:]reason
+		 * Ex:	ADD +30d cdjp idiot!moron@somewhere.com Annoying spammer
+		 * Ex:	ADD +30d * helper!help@*.isp.com#Here to help :Impersonating staff and spamming
+		 */
+
+		if (params.size() < 4)
+		{
+			this->OnSyntaxError(source, "ADD");
+			return;
+		}
+
+		expiry = params[1];
+		time_t expires = Anope::DoTime(expiry);
+		/* Like AKILL, default to days if not specified */
+		if (isdigit(expiry[expiry.length() - 1]))
+			expires *= 86400;
+		if (expires > 0)
+			expires += Anope::CurTime;
+
+		/* Acceptable flags are:
+		 * c = Connects
+		 * d = Disconnects
+		 * i = channel Invites
+		 * j = channel Joins
+		 * k = channel Kicks
+		 * m = channel Modes
+		 * n = Nick changes
+		 * p = channel Parts
+		 * s = Services commands (-SET)
+		 * S = Services SET commands
+		 * t = Topics
+		 * u = Usermodes
+		 */
+		str_flags = params[2];
+
+		if (str_flags == "*")
+		{
+			str_flags = NotifyFlagChars;
+		}
+		else if (str_flags.find_first_not_of(NotifyFlagChars) != Anope::string::npos)
+		{
+			source.Reply("Incorrect flags character(s) given.");
+			return;
+		}
+
+		const unsigned flags = NotifyFlagsFromString(str_flags);
+
+		spacesepstream sep(params[3]);
+		sep.GetToken(mask);
+
+		if (sep.StreamEnd())
+		{
+			this->OnSyntaxError(source, "ADD");
+			return;
+		}
+
+		size_t pound = mask.find('#');
+		size_t at = mask.find('@');
+
+		/* If '#' is after '@', we've got a real name */
+		if ((pound != Anope::string::npos && at != Anope::string::npos) && pound > at)
+		{
+			const Anope::string remaining = sep.GetRemaining();
+
+			size_t co = remaining[0] == ':' ? 0 : remaining.rfind(" :");
+			if (co == Anope::string::npos)
+			{
+				this->OnSyntaxError(source, "ADD");
+				return;
+			}
+
+			if (co != 0)
+				++co;
+
+			reason = remaining.substr(co + 1);
+			mask += " " + remaining.substr(0, co);
+			mask.trim();
+		}
+		else
+		{
+			reason = sep.GetRemaining();
+		}
+
+		Anope::string error;
+		if (!this->ValidateMask(source, mask, error))
+		{
+			source.Reply("%s", error.c_str());
+			return;
+		}
+
+		NotifyEntry *ne = const_cast<NotifyEntry *>(NotifyList.GetNotify(mask));
+		bool created = true;
+		if (ne)
+		{
+			created = false;
+			delete ne;
+		}
+		ne = new NotifyEntry();
+
+		ne->SetMask(mask);
+		ne->reason = reason;
+		ne->flags = flags;
+		ne->creator = source.GetNick();
+		ne->created = Anope::CurTime;
+		ne->expires = expires;
+		NotifyList.AddNotify(ne);
+
+		if (Anope::ReadOnly)
+			source.Reply(READ_ONLY_MODE);
+
+		unsigned matches = 0;
+
+		/* If mask contains '#' but not '@', it's a channel mask */
+		if (pound != Anope::string::npos && at == Anope::string::npos)
+		{
+			for (channel_map::const_iterator it = ChannelList.begin(); it != ChannelList.end(); ++it)
+			{
+				const Channel *c = it->second;
+
+				if (!NotifyList.Check(c, ne))
+					continue;
+
+				for (Channel::ChanUserList::const_iterator i = c->users.begin(); i != c->users.end(); ++i)
+				{
+					const User *u = i->first;
+
+					if (NotifyList.ExistsAlready(u, ne))
+						continue;
+
+					NotifyList.AddMatch(u, ne);
+					matches++;
+				}
+			}
+		}
+		else
+		{
+			for (user_map::const_iterator it = UserListByNick.begin(); it != UserListByNick.end(); ++it)
+			{
+				User *u = it->second;
+
+				if (NotifyList.Check(u, ne))
+				{
+					NotifyList.AddMatch(u, ne);
+					matches++;
+				}
+			}
+		}
+
+		Log(LOG_ADMIN, source, this) << "to " << (created ? "add" : "modify") << " a notify on " << mask << " for reason: " << reason << " (matches: " << matches << " user(s))";
+		source.Reply("%s a notify on %s which matched %d user(s).", (created ? "Added" : "Modified"), mask.c_str(), matches);
+	}
+
+	/* Import entries from a file of lines in the format EXPORT writes:
+	 * mask<TAB>flags<TAB>expires<TAB>created<TAB>creator<TAB>reason
+	 * All Users and Channels are then matched against the new entries at once.
+	 */
+	void DoImport(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (params.size() < 2)
+		{
+			this->OnSyntaxError(source, "IMPORT");
+			return;
+		}
+
+		Anope::string name = params[1], path;
+		if (!this->GetListFile(source, name, path))
+			return;
+
+		std::ifstream in(path.c_str());
+		if (!in.is_open())
+		{
+			source.Reply("Unable to open \002%s\002 for reading.", name.c_str());
+			return;
+		}
+
+		if (Anope::ReadOnly)
+			source.Reply(READ_ONLY_MODE);
+
+		std::vector<NotifyEntry *> imported;
+		unsigned lineno = 0, skipped = 0;
+		std::string buf;
+		while (std::getline(in, buf))
+		{
+			++lineno;
+
+			Anope::string line = buf;
+			line.rtrim("\r\n");
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			sepstream sep(line, '\t', true);
+			Anope::string mask, str_flags, str_expires, str_created, creator;
+			sep.GetToken(mask);
+			sep.GetToken(str_flags);
+			sep.GetToken(str_expires);
+			sep.GetToken(str_created);
+			sep.GetToken(creator);
+			const Anope::string reason = sep.GetRemaining();
+
+			time_t expires = 0, created = Anope::CurTime;
+			try
+			{
+				expires = convertTo<time_t>(str_expires);
+				if (!str_created.empty())
+					created = convertTo<time_t>(str_created);
+			}
+			catch (const ConvertException &)
+			{
+				if (skipped++ < MaxImportErrors)
+					source.Reply("Line %u: invalid expiry or creation time.", lineno);
+				continue;
+			}
+
+			if (str_flags == "*")
+				str_flags = NotifyFlagChars;
+
+			Anope::string error;
+			if (reason.empty() || str_flags.empty() || str_flags.find_first_not_of(NotifyFlagChars) != Anope::string::npos)
+				error = "missing reason or incorrect flags.";
+			else if (expires && expires <= Anope::CurTime)
+				error = "the entry has already expired.";
+			else
+				this->ValidateMask(source, mask, error);
+
+			if (!error.empty())
+			{
+				if (skipped++ < MaxImportErrors)
+					source.Reply("Line %u: %s", lineno, error.c_str());
+				continue;
+			}
+
+			/* Replace an existing entry, as ADD does */
+			const NotifyEntry *old = NotifyList.GetNotify(mask);
+			if (old)
+			{
+				std::vector<NotifyEntry *>::iterator it = std::find(imported.begin(), imported.end(), old);
+				if (it != imported.end())
+					imported.erase(it);
+				delete old;
+			}
+
+			NotifyEntry *ne = new NotifyEntry();
+			ne->SetMask(mask);
+			ne->reason = reason;
+			ne->flags = NotifyFlagsFromString(str_flags);
+			ne->creator = creator.empty() ? source.GetNick() : creator;
+			ne->created = created;
+			ne->expires = expires;
+			NotifyList.AddNotify(ne);
+			imported.push_back(ne);
+		}
+
+		if (skipped > MaxImportErrors)
+			source.Reply("... and %u more invalid lines.", skipped - MaxImportErrors);
+
+		unsigned matches = 0;
+		if (!imported.empty())
+		{
+			std::sort(imported.begin(), imported.end());
+			matches = this->MatchImported(imported);
+
+			if (!Anope::ReadOnly)
+				Anope::SaveDatabases();
+		}
+
+		Log(LOG_ADMIN, source, this) << "to import " << imported.size() << " notify entries from " << name << " (matches: " << matches << " user(s))";
+		source.Reply("Imported %u notify entries from \002%s\002 (%u skipped) which matched %u user(s).", static_cast<unsigned>(imported.size()), name.c_str(), skipped, matches);
+	}
+
+	/* One pass over all Users and Channels for the (sorted) imported entries */
+	unsigned MatchImported(const std::vector<NotifyEntry *> &imported)
+	{
+		unsigned matches = 0;
+		std::vector<NotifyEntry *> candidates;
+
+		for (user_map::const_iterator it = UserListByNick.begin(); it != UserListByNick.end(); ++it)
+		{
+			User *u = it->second;
+			if (u->server && u->server->IsULined())
+				continue;
+
+			const NotifyTarget target(u);
+			NotifyList.GetCandidates(target, candidates);
+
+			bool matched = false;
+			for (unsigned i = 0; i < candidates.size(); ++i)
+			{
+				NotifyEntry *ne = candidates[i];
+				if (!std::binary_search(imported.begin(), imported.end(), ne) || !NotifyList.Check(target, ne))
+					continue;
+
+				NotifyList.AddMatch(u, ne);
+				matched = true;
+			}
+
+			if (matched)
+				matches++;
+		}
+
+		for (channel_map::const_iterator it = ChannelList.begin(); it != ChannelList.end(); ++it)
+		{
+			Channel *c = it->second;
+			const std::vector<NotifyEntry *> &chanmatches = NotifyList.GetChannelMatches(c);
+
+			for (unsigned i = 0; i < chanmatches.size(); ++i)
+			{
+				const NotifyEntry *ne = chanmatches[i];
+				if (!std::binary_search(imported.begin(), imported.end(), ne))
+					continue;
+
+				for (Channel::ChanUserList::const_iterator cit = c->users.begin(); cit != c->users.end(); ++cit)
+				{
+					const User *u = cit->first;
+					if (NotifyList.ExistsAlready(u, ne))
+						continue;
+
+					NotifyList.AddMatch(u, ne);
+					matches++;
+				}
+			}
+		}
+
+		return matches;
+	}
+
+	void DoExport(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (params.size() < 2)
+		{
+			this->OnSyntaxError(source, "EXPORT");
+			return;
+		}
+
+		if (NotifyList.GetNotifiesCount() == 0)
+		{
+			source.Reply("The notify list is empty.");
+			return;
+		}
+
+		Anope::string name = params[1], path;
+		if (!this->GetListFile(source, name, path))
+			return;
+
+		/* Only overwrite an earlier export, recognized by its first line */
+		std::ifstream existing(path.c_str());
+		if (existing.is_open())
+		{
+			std::string first;
+			std::getline(existing, first);
+			if (Anope::string(first).rtrim("\r\n") != NotifyFileHeader)
+			{
+				source.Reply("\002%s\002 already exists and was not written by \002EXPORT\002.", name.c_str());
+				return;
+			}
+			existing.close();
+		}
+
+		std::ofstream out(path.c_str(), std::ios_base::out | std::ios_base::trunc);
+		if (!out.is_open())
+		{
+			source.Reply("Unable to open \002%s\002 for writing.", name.c_str());
+			return;
+		}
+
+		out << NotifyFileHeader << std::endl;
+
+		const std::vector<NotifyEntry *> &notifies = NotifyList.GetNotifies();
+		for (unsigned i = 0; i < notifies.size(); ++i)
+		{
+			const NotifyEntry *ne = notifies.at(i);
+			out << ne->mask << '\t' << NotifyFlagsToString(ne->flags) << '\t' << ne->expires << '\t' << ne->created << '\t'
+				<< ne->creator << '\t' << ne->reason << std::endl;
+		}
+		out.close();
+
+		Log(LOG_ADMIN, source, this) << "to export " << notifies.size() << " notify entries to " << name;
+		source.Reply("Exported %u notify entries to \002%s\002.", static_cast<unsigned>(notifies.size()), name.c_str());
+	}
+
+	void DoDel(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		const Anope::string &match = params.size() > 1 ? params[1] : "";
+
+		if (match.empty())
+		{
+			this->OnSyntaxError(source, "DEL");
+			return;
+		}
+
+		if (NotifyList.GetNotifiesCount() == 0)
+		{
+			source.Reply("The notify list is empty.");
+			return;
+		}
+
+		if (isdigit(match[0]) && match.find_first_not_of("1234567890,-") == Anope::string::npos)
+		{
+			NotifyDelCallback list(source, match, this);
+			list.Process();
+		}
+		else
+		{
+			const NotifyEntry *ne = NotifyList.GetNotify(match);
+			if (!ne)
+			{
+				source.Reply("\002%s\002 not found on the notify list.", match.c_str());
+				return;
+			}
+
+			if (Anope::ReadOnly)
+				source.Reply(READ_ONLY_MODE);
+
+			Log(LOG_ADMIN, source, this) << "to remove " << ne->mask << " from the list";
+			source.Reply("\002%s\002 deleted from the notify list.", ne->mask.c_str());
+			delete ne;
+		}
+	}
+
+	void ProcessList(CommandSource &source, const std::vector<Anope::string> &params, ListFormatter &list)
+	{
+		const Anope::string &match = params.size() > 1 ? params[1] : "";
+
+		if (!match.empty() && isdigit(match[0]) && match.find_first_not_of("1234567890,-") == Anope::string::npos)
+		{
+			class ListCallback : public NumberList
+			{
+				CommandSource &source;
+				ListFormatter &list;
+
+			 public:
+				ListCallback(CommandSource &_source, ListFormatter &_list, const Anope::string &numstr) : NumberList(numstr, false), source(_source), list(_list) { }
+
+				void HandleNumber(unsigned number) anope_override
+				{
+					if (!number)
+						return;
+
+					const NotifyEntry *ne = NotifyList.GetNotify(number - 1);
+					if (!ne)
+						return;
+
+					ListFormatter::ListEntry entry;
+					entry["Number"] = stringify(number);
+					entry["Mask"] = ne->mask;
+					entry["Flags"] = NotifyFlagsToString(ne->flags);
+					entry["Reason"] = ne->reason;
+					entry["Created"] = Anope::strftime(ne->created, source.nc, true);
+					entry["By"] = ne->creator;
 					entry["Expires"] = Anope::Expires(ne->expires, source.nc);
 					list.AddEntry(entry);
 				}
@@ -627,7 +2013,7 @@ class CommandOSNotify : public Command
 					ListFormatter::ListEntry entry;
 					entry["Number"] = stringify(i + 1);
 					entry["Mask"] = ne->mask;
-					entry["Flags"] = Anope::string(ne->flags.begin(), ne->flags.end());
+					entry["Flags"] = NotifyFlagsToString(ne->flags);
 					entry["Reason"] = ne->reason;
 					entry["Created"] = Anope::strftime(ne->created, source.nc, true);
 					entry["By"] = ne->creator;
@@ -641,7 +2027,104 @@ class CommandOSNotify : public Command
 			source.Reply("No matching entries on the notify list.");
 		else
 		{
-			source.Reply("Current notify list:");
+			source.Reply("Current notify list:");
+
+			std::vector<Anope::string> replies;
+			list.Process(replies);
+
+			for (unsigned i = 0; i < replies.size(); ++i)
+				source.Reply(replies[i]);
+
+			source.Reply("End of notify list.");
+		}
+	}
+
+	void DoList(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (NotifyList.GetNotifiesCount() == 0)
+		{
+			source.Reply("The notify list is empty.");
+			return;
+		}
+
+		ListFormatter list(source.GetAccount());
+		list.AddColumn("Number").AddColumn("Mask").AddColumn("Reason");
+
+		this->ProcessList(source, params, list);
+	}
+
+	void DoView(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (NotifyList.GetNotifiesCount() == 0)
+		{
+			source.Reply("The notify list is empty.");
+			return;
+		}
+
+		ListFormatter list(source.GetAccount());
+		list.AddColumn("Number").AddColumn("Mask").AddColumn("Flags").AddColumn("Reason");
+		list.AddColumn("Created").AddColumn("By").AddColumn("Expires");
+
+		this->ProcessList(source, params, list);
+	}
+
+	void DoClear(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (NotifyList.GetNotifiesCount() == 0)
+		{
+			source.Reply("The notify list is empty.");
+			return;
+		}
+
+		if (Anope::ReadOnly)
+			source.Reply(READ_ONLY_MODE);
+
+		NotifyList.ClearNotifies();
+		Log(LOG_ADMIN, source, this) << "to clear the list";
+		source.Reply("The notify list has been cleared.");
+	}
+
+	void DoShow(CommandSource &source, const std::vector<Anope::string> &params)
+	{
+		if (!NotifyList.HasMatches())
+		{
+			source.Reply("No matching Users are currently online.");
+			return;
+		}
+
+		ListFormatter list(source.GetAccount());
+		list.AddColumn("Flags/Nick").AddColumn("Mask").AddColumn("Reason/Online Since");
+
+		const std::vector<NotifyEntry *> &notifies = NotifyList.GetNotifies();
+		for (unsigned i = 0; i < notifies.size(); ++i)
+		{
+			const NotifyEntry *ne = notifies.at(i);
+			if (!ne || !ne->users)
+				continue;
+
+			ListFormatter::ListEntry entry;
+			entry["Flags/Nick"] = NotifyFlagsToString(ne->flags);
+			entry["Mask"] = ne->mask;
+			entry["Reason/Online Since"] = ne->reason;
+			list.AddEntry(entry);
+
+			for (const NotifyMatch *nm = ne->users; nm; nm = nm->next)
+			{
+				const User *u = nm->user;
+
+				ListFormatter::ListEntry subentry;
+				subentry["Flags/Nick"] = u->nick;
+				subentry["Mask"] = u->GetIdent() + "@" + u->host + "#" + u->realname;
+				subentry["Reason/Online Since"] = Anope::strftime(u->signon, source.nc, true);
+				list.AddEntry(subentry);
+			}
+		}
+
+		if (list.IsEmpty())
+			source.Reply("No matching entries currently online.");
+		else
+		{
+			source.Reply("Currently matched online users:");
 
 			std::vector<Anope::string> replies;
 			list.Process(replies);
@@ -649,11 +2132,11 @@ class CommandOSNotify : public Command
 			for (unsigned i = 0; i < replies.size(); ++i)
 				source.Reply(replies[i]);
 
-			source.Reply("End of notify list.");
+			source.Reply("End of matched online users.");
 		}
 	}
 
-	void DoList(CommandSource &source, const std::vector<Anope::string> &params)
+	void DoStats(CommandSource &source, const std::vector<Anope::string> &params)
 	{
 		if (NotifyList.GetNotifiesCount() == 0)
 		{
@@ -661,13 +2144,82 @@ class CommandOSNotify : public Command
 			return;
 		}
 
+		const Anope::string &match = params.size() > 1 ? params[1] : "";
+		const std::vector<NotifyEntry *> &notifies = NotifyList.GetNotifies();
+
 		ListFormatter list(source.GetAccount());
-		list.AddColumn("Number").AddColumn("Mask").AddColumn("Reason");
+		list.AddColumn("Number").AddColumn("Mask").AddColumn("Online").AddColumn("Matches").AddColumn("Events").AddColumn("Last hit");
 
-		this->ProcessList(source, params, list);
+		for (unsigned i = 0; i < notifies.size(); ++i)
+		{
+			const NotifyEntry *ne = notifies.at(i);
+			if (!match.empty() && match != stringify(i + 1) && !match.equals_ci(ne->mask))
+				continue;
+
+			unsigned online = 0;
+			for (const NotifyMatch *nm = ne->users; nm; nm = nm->next)
+				online++;
+
+			ListFormatter::ListEntry entry;
+			entry["Number"] = stringify(i + 1);
+			entry["Mask"] = ne->mask;
+			entry["Online"] = stringify(online);
+			entry["Matches"] = stringify(ne->hits);
+			entry["Events"] = stringify(ne->events);
+			entry["Last hit"] = ne->lasthit ? Anope::strftime(ne->lasthit, source.nc, true) : "Never";
+			list.AddEntry(entry);
+		}
+
+		if (list.IsEmpty())
+		{
+			source.Reply("\002%s\002 not found on the notify list.", match.c_str());
+			return;
+		}
+
+		std::vector<Anope::string> replies;
+		list.Process(replies);
+
+		source.Reply("Notify entry statistics:");
+		for (unsigned i = 0; i < replies.size(); ++i)
+			source.Reply(replies[i]);
+
+		if (match.empty())
+		{
+			ListFormatter latency(source.GetAccount());
+			latency.AddColumn("Type").AddColumn("Checks").AddColumn("Timed").AddColumn("Average").AddColumn("<1us").AddColumn("<10us")
+				.AddColumn("<100us").AddColumn("<1ms").AddColumn("<10ms").AddColumn(">=10ms");
+
+			for (unsigned i = 0; i < NCK_SIZE; ++i)
+			{
+				const NotifyLatency &nl = NotifyList.GetLatency(static_cast<NotifyCheckKind>(i));
+
+				ListFormatter::ListEntry entry;
+				entry["Type"] = NotifyCheckKindNames[i];
+				entry["Checks"] = stringify(nl.checks);
+				entry["Timed"] = stringify(nl.timed);
+				entry["Average"] = stringify(nl.timed ? nl.total / nl.timed : 0) + "us";
+				entry["<1us"] = stringify(nl.counts[0]);
+				entry["<10us"] = stringify(nl.counts[1]);
+				entry["<100us"] = stringify(nl.counts[2]);
+				entry["<1ms"] = stringify(nl.counts[3]);
+				entry["<10ms"] = stringify(nl.counts[4]);
+				entry[">=10ms"] = stringify(nl.counts[5]);
+				latency.AddEntry(entry);
+			}
+
+			replies.clear();
+			latency.Process(replies);
+
+			source.Reply(" ");
+			source.Reply("Mask check latency:");
+			for (unsigned i = 0; i < replies.size(); ++i)
+				source.Reply(replies[i]);
+		}
+
+		source.Reply("End of notify statistics.");
 	}
 
-	void DoView(CommandSource &source, const std::vector<Anope::string> &params)
+	void DoRemove(CommandSource &source, const std::vector<Anope::string> &params)
 	{
 		if (NotifyList.GetNotifiesCount() == 0)
 		{
@@ -675,237 +2227,538 @@ class CommandOSNotify : public Command
 			return;
 		}
 
-		ListFormatter list(source.GetAccount());
-		list.AddColumn("Number").AddColumn("Mask").AddColumn("Flags").AddColumn("Reason");
-		list.AddColumn("Created").AddColumn("By").AddColumn("Expires");
+		if (params.size() < 2 || params.size() > 2)
+		{
+			this->OnSyntaxError(source, "REMOVE");
+			return;
+		}
 
-		this->ProcessList(source, params, list);
+		if (!NotifyList.HasMatches())
+		{
+			source.Reply("No matching Users are currently online.");
+			return;
+		}
+
+		const User *u = User::Find(params[1], true);
+		if (!u)
+		{
+			source.Reply("No user found by the nick of %s", params[1].c_str());
+			return;
+		}
+
+		if (!NotifyList.IsMatch(u))
+		{
+			source.Reply("%s is not currently a matched User.", u->nick.c_str());
+			return;
+		}
+
+		NotifyList.DelMatch(u);
+		Log(LOG_ADMIN, source, this) << "to remove " << u->nick << " from the matched Users list for Notify";
+		source.Reply("%s has been removed the matched Users list.", u->nick.c_str());
 	}
 
-	void DoClear(CommandSource &source, const std::vector<Anope::string> &params)
+ public:
+	CommandOSNotify(Module *creator) : Command(creator, "operserv/notify", 1, 4)
 	{
-		if (NotifyList.GetNotifiesCount() == 0)
+		this->SetDesc("Manipulate the Notify (watch) list");
+		this->SetSyntax("ADD +\037expiry\037 \037flags\037 \037mask\037 [:]\037reason\037");
+		this->SetSyntax("DEL [\037mask\037 | \037entry-num\037 | \037list\037]");
+		this->SetSyntax("LIST [\037mask\037 | \037entry-num\037 | \037list\037]");
+		this->SetSyntax("VIEW [\037mask\037 | \037entry-num\037 | \037list\037]");
+		this->SetSyntax("CLEAR");
+		this->SetSyntax("SHOW [\037mask\037 | \037entry-num\037 | \037list\037]");
+		this->SetSyntax("REMOVE \037nick\037");
+		this->SetSyntax("STATS [\037mask\037 | \037entry-num\037]");
+		this->SetSyntax("IMPORT \037file\037");
+		this->SetSyntax("EXPORT \037file\037");
+	}
+
+	void Execute(CommandSource &source, const std::vector<Anope::string> &params) anope_override
+	{
+		const Anope::string &subcmd = params[0];
+
+		if (subcmd.equals_ci("ADD"))
+			this->DoAdd(source, params);
+		else if (subcmd.equals_ci("DEL"))
+			this->DoDel(source, params);
+		else if (subcmd.equals_ci("LIST"))
+			this->DoList(source, params);
+		else if (subcmd.equals_ci("VIEW"))
+			this->DoView(source, params);
+		else if (subcmd.equals_ci("CLEAR"))
+			this->DoClear(source, params);
+		else if (subcmd.equals_ci("SHOW"))
+			this->DoShow(source, params);
+		else if (subcmd.equals_ci("REMOVE"))
+			this->DoRemove(source, params);
+		else if (subcmd.equals_ci("STATS"))
+			this->DoStats(source, params);
+		else if (subcmd.equals_ci("IMPORT"))
+			this->DoImport(source, params);
+		else if (subcmd.equals_ci("EXPORT"))
+			this->DoExport(source, params);
+		else
+			this->OnSyntaxError(source, "");
+	}
+
+	bool OnHelp(CommandSource &source, const Anope::string &subcommand) anope_override
+	{
+		this->SendSyntax(source);
+		source.Reply(" ");
+		source.Reply("Notify allows Opers to create a list of masks that Users are matched against.\n"
+			     "Matching Users have many of their 'events' tracked and logged\n"
+			     "(typically to a log channel) for Opers to monitor.");
+		source.Reply(" ");
+		source.Reply("The \002ADD\002 command adds the given mask to the Notify list.\n"
+			     "Reason \002must\002 be given and the mask should be in the format of\n"
+			     "nick!user@host#real name (though all that is required is user@host) or\n"
+			     "#channel to track users that join a matching channel.\n"
+			     "If a real name is specified, the reason must be prepended with a :.\n"
+			     "Flags are used to decide what to track, for all use \037*\037.\n"
+			     "The available flags are:\n"
+			     "c - User Connections\nd - User Disconnections\n"
+			     "i - Channel Invites\nj - Channel Joins\n"
+			     "k - Channel Kicks\nm - Channel Modes\n"
+			     "n - User Nick changes\np - Channel Parts\n"
+			     "s - Most Services commands\nS - More Services commands\n"
+			     "t - Channel Topics\nu - User Modes\n"
+			     "\037expiry\037 is specified as an integer followed by one of \037d\37 (days),\n"
+			     " \037h\037 (hours), or \037m\037 (minutes). Combinations (such as \0371h30m\037)\n"
+			     "are not permitted. If a unit specifier is not included, the default is days\n"
+			     "(so \037+30\037 by itself means 30 days).\n"
+			     "To add a Notify which does not expire, use \037+0\037.");
+
+		const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
+		if (!regexengine.empty())
 		{
-			source.Reply("The notify list is empty.");
-			return;
+			source.Reply(" ");
+			source.Reply("Regex matches are also supported using the %s engine.\n"
+				     "Note that for a user mask, this will ONLY match against\n"
+				     "either \037user@host\037 or \037nick!user@host#real\037\n"
+				     "Enclose your pattern in // if this is desired.", regexengine.c_str());
 		}
 
-		if (Anope::ReadOnly)
-			source.Reply(READ_ONLY_MODE);
+		source.Reply(" ");
+		source.Reply("The \002DEL\002 command requires a parameter, one of a mask to match,\n"
+			     "an entry number, or a list of entry numbers (1-5 or 1-3,5 format).\n"
+			     "The \002LIST\002 and \002VIEW\002 commands can be used with no\n"
+			     "parameters or with one of the above parameters, for DEL.\n");
+		source.Reply("The \002CLEAR\002 command clears all entries of the Notify list.");
+		source.Reply(" ");
+		source.Reply("The \002SHOW\002 command lists Notify masks with currently matched Users\n"
+			     "It can accept the same parameters as the \002LIST\002 and\n"
+			     "\002VIEW\002 commands, including no parameters at all.");
+		source.Reply("The \002REMOVE\002 command removes a user from the matched Users list.\n"
+			     "This can be useful if a user gets matched by a playful/silly nick change\n"
+			     "or as a temporary removal of tracking of the user.");
+		source.Reply(" ");
+		source.Reply("The \002STATS\002 command shows how many times each entry matched\n"
+			     "a User and how many of their events it logged since services started.\n"
+			     "Without a parameter it also shows how long checking each type of mask\n"
+			     "takes (timing one in 64 checks), to help find expensive masks.");
+		source.Reply(" ");
+		source.Reply("The \002EXPORT\002 command writes the Notify list to a .notify file in the\n"
+			     "services data directory (the extension is added if missing), and only\n"
+			     "overwrites files it wrote before. Each entry is one line of tab separated fields:\n"
+			     "mask, flags, expiry and creation time (as timestamps, 0 never expires),\n"
+			     "creator and reason.\n"
+			     "The \002IMPORT\002 command adds the entries from such a file, replacing\n"
+			     "entries with the same mask, then matches all Users against them at once.\n"
+			     "The creation time and creator can be left empty.");
 
-		NotifyList.ClearNotifies();
-		Log(LOG_ADMIN, source, this) << "to clear the list";
-		source.Reply("The notify list has been cleared.");
+		return true;
 	}
 
-	void DoShow(CommandSource &source, const std::vector<Anope::string> &params)
+	void OnSyntaxError(CommandSource &source, const Anope::string &subcommand)
+	{
+		if (subcommand.equals_ci("ADD"))
+			source.Reply("ADD +\037expiry\037 \037flags\037 \037mask\037 [:]\037reason\037");
+		else if (subcommand.equals_ci("DEL"))
+			source.Reply("DEL [\037mask\037 | \037entry-num\037 | \037list\037]");
+		else if (subcommand.equals_ci("REMOVE"))
+			source.Reply("REMOVE \037nick\037");
+		else if (subcommand.equals_ci("STATS"))
+			source.Reply("STATS [\037mask\037 | \037entry-num\037]");
+		else if (subcommand.equals_ci("IMPORT"))
+			source.Reply("IMPORT \037file\037");
+		else if (subcommand.equals_ci("EXPORT"))
+			source.Reply("EXPORT \037file\037");
+		else
+			this->SendSyntax(source);
+	}
+};
+
+/* Bounded ring of notify log lines. Hooks only queue their line, the
+ * queue is written out in one batch per pass of the event loop (woken
+ * through the Pipe). Lines that don't fit are dropped and counted.
+ */
+class NotifyLogQueue : public Pipe
+{
+	struct Line
+	{
+		Anope::string category;
+		Anope::string text;
+	};
+
+	std::vector<Line> ring;
+	size_t head, count;
+	unsigned long dropped;
+	bool notified;
+
+	void Write(const Anope::string &category, const Anope::string &text)
+	{
+		Log(LOG_NORMAL, "notify/" + category, this->bot) << "NOTIFY: " << text;
+	}
+
+ public:
+	BotInfo *bot;
+
+	NotifyLogQueue() : head(0), count(0), dropped(0), notified(false), bot(NULL) { }
+
+	/* A size of 0 writes every line straight away */
+	void SetSize(size_t size)
+	{
+		if (size == ring.size())
+			return;
+
+		this->Flush();
+		ring.clear();
+		ring.resize(size);
+		head = 0;
+	}
+
+	void Push(const Anope::string &category, const Anope::string &text)
 	{
-		const PerEntryMap &current = NotifyList.GetEntryMap();
-		if (current.empty())
+		if (ring.empty())
 		{
-			source.Reply("No matching Users are currently online.");
+			this->Write(category, text);
 			return;
 		}
 
-		ListFormatter list(source.GetAccount());
-		list.AddColumn("Flags/Nick").AddColumn("Mask").AddColumn("Reason/Online Since");
+		if (count == ring.size())
+		{
+			++dropped;
+			return;
+		}
 
-		Anope::string last_mask;
-		for (PerEntryMap::const_iterator it = current.begin(); it != current.end(); ++it)
+		Line &line = ring[(head + count) % ring.size()];
+		line.category = category;
+		line.text = text;
+		++count;
+
+		if (!notified)
 		{
-			const NotifyEntry *ne = it->first;
-			const User *u = it->second;
-			if (!ne || !u)
-				continue;
+			notified = true;
+			this->Notify();
+		}
+	}
 
-			if (last_mask != ne->mask)
-			{
-				ListFormatter::ListEntry entry;
-				entry["Flags/Nick"] = Anope::string(ne->flags.begin(), ne->flags.end());
-				entry["Mask"] = ne->mask;
-				entry["Reason/Online Since"] = ne->reason;
-				list.AddEntry(entry);
+	void Flush()
+	{
+		while (count > 0)
+		{
+			Line &line = ring[head];
+			this->Write(line.category, line.text);
+			line.text.clear();
 
-				last_mask = ne->mask;
-			}
+			head = (head + 1) % ring.size();
+			--count;
+		}
 
-			ListFormatter::ListEntry subentry;
-			subentry["Flags/Nick"] = u->nick;
-			subentry["Mask"] = u->GetIdent() + "@" + u->host + "#" + u->realname;
-			subentry["Reason/Online Since"] = Anope::strftime(u->signon, source.nc, true);
-			list.AddEntry(subentry);
+		if (dropped > 0)
+		{
+			Log(LOG_NORMAL, "notify/user", this->bot) << "NOTIFY: Dropped " << dropped << " notification(s), the log queue (size " << ring.size() << ") was full";
+			dropped = 0;
 		}
 
-		if (list.IsEmpty())
-			source.Reply("No matching entries currently online.");
+		notified = false;
+	}
+
+	void OnNotify() anope_override
+	{
+		this->Flush();
+	}
+};
+
+/* Kinds of repetitive events that are folded into a summary */
+enum NotifyFoldKind
+{
+	NFK_JOIN,
+	NFK_PART,
+	NFK_CHANMODE,
+	NFK_USERMODE,
+	NFK_SIZE
+};
+
+/* Events of one kind folded during a window, the first one of the
+ * window is logged as usual and the rest are summarized at its end.
+ */
+struct NotifyFold
+{
+	/* Most targets listed in a summary */
+	static const unsigned MaxTargets = 20;
+
+	time_t until;		/* End of the window, 0 while none is open */
+	unsigned events;	/* Events folded so far */
+	std::vector<Anope::string> targets;
+	bool truncated;
+
+	NotifyFold() : until(0), events(0), truncated(false) { }
+
+	void Add(const Anope::string &target)
+	{
+		++events;
+		if (std::find(targets.begin(), targets.end(), target) != targets.end())
+			return;
+
+		if (targets.size() < MaxTargets)
+			targets.push_back(target);
 		else
+			truncated = true;
+	}
+
+	void Reset()
+	{
+		until = 0;
+		events = 0;
+		targets.clear();
+		truncated = false;
+	}
+};
+
+struct NotifyUserFolds
+{
+	User *user;
+	NotifyFold folds[NFK_SIZE];
+
+	NotifyUserFolds(Extensible *e) : user(static_cast<User *>(e)) { }
+	~NotifyUserFolds();
+};
+
+/* Folds repetitive events of matched Users, see 'foldtime' */
+class NotifyFolder : public Timer
+{
+	ExtensibleItem<NotifyUserFolds> userfolds;
+	NotifyLogQueue &logqueue;
+	std::set<NotifyUserFolds *> open;	/* Users with an open window */
+
+	void Summarize(const NotifyUserFolds *uf, NotifyFoldKind kind)
+	{
+		const NotifyFold &fold = uf->folds[kind];
+		if (!fold.events)
+			return;
+
+		Anope::string targets;
+		for (unsigned i = 0; i < fold.targets.size(); ++i)
+			targets += (i ? ", " : "") + fold.targets[i];
+		if (fold.truncated)
+			targets += ", ...";
+
+		Anope::string text = "'" + BuildNUHR(uf->user) + "' ";
+		switch (kind)
 		{
-			source.Reply("Currently matched online users:");
+			case NFK_JOIN:
+				text += "joined " + targets + " [" + stringify(fold.events) + " more join(s)";
+				break;
+			case NFK_PART:
+				text += "parted " + targets + " [" + stringify(fold.events) + " more part(s)";
+				break;
+			case NFK_CHANMODE:
+				text += "set channel modes on " + targets + " [" + stringify(fold.events) + " more mode change(s)";
+				break;
+			default:
+				text += "set modes " + targets + " [" + stringify(fold.events) + " more mode change(s)";
+		}
+		text += " folded within " + stringify(this->window) + "s]";
 
-			std::vector<Anope::string> replies;
-			list.Process(replies);
+		logqueue.Push(kind == NFK_USERMODE ? "user" : "channel", text);
+	}
 
-			for (unsigned i = 0; i < replies.size(); ++i)
-				source.Reply(replies[i]);
+	/* Summarize the due (or all) windows, returning if any are still open */
+	bool Flush(NotifyUserFolds *uf, bool all)
+	{
+		bool pending = false;
+		for (unsigned i = 0; i < NFK_SIZE; ++i)
+		{
+			NotifyFold &fold = uf->folds[i];
+			if (!fold.until)
+				continue;
+
+			if (!all && fold.until > Anope::CurTime)
+			{
+				pending = true;
+				continue;
+			}
 
-			source.Reply("End of matched online users.");
+			this->Summarize(uf, static_cast<NotifyFoldKind>(i));
+			fold.Reset();
 		}
+
+		return pending;
 	}
 
-	void DoRemove(CommandSource &source, const std::vector<Anope::string> &params)
+	void Schedule()
 	{
-		if (NotifyList.GetNotifiesCount() == 0)
+		time_t next = 0;
+		for (std::set<NotifyUserFolds *>::const_iterator it = open.begin(); it != open.end(); ++it)
 		{
-			source.Reply("The notify list is empty.");
-			return;
+			for (unsigned i = 0; i < NFK_SIZE; ++i)
+			{
+				const time_t until = (*it)->folds[i].until;
+				if (until && (!next || until < next))
+					next = until;
+			}
 		}
 
-		if (params.size() < 2 || params.size() > 2)
-		{
-			this->OnSyntaxError(source, "REMOVE");
-			return;
-		}
+		this->SetSecs(next ? std::max<time_t>(next - Anope::CurTime, 1) : NotifyExpireTimer::IdleSecs);
+	}
 
-		const PerUserMap &current = NotifyList.GetUserMap();
-		if (current.empty())
-		{
-			source.Reply("No matching Users are currently online.");
-			return;
-		}
+ public:
+	time_t window;	/* 0 to disable folding */
 
-		const User *u = User::Find(params[1], true);
-		if (!u)
-		{
-			source.Reply("No user found by the nick of %s", params[1].c_str());
-			return;
-		}
+	NotifyFolder(Module *me, NotifyLogQueue &lq) : Timer(me, NotifyExpireTimer::IdleSecs, Anope::CurTime, true),
+		userfolds(me, "notify_folds"), logqueue(lq), window(0) { }
 
-		if (!NotifyList.IsMatch(u))
+	/* Fold an event into the User's open window, returning false
+	 * if it should be logged as usual (it opened a new window).
+	 */
+	bool Fold(User *u, NotifyFoldKind kind, const Anope::string &target)
+	{
+		if (!this->window)
+			return false;
+
+		NotifyUserFolds *uf = userfolds.Require(u);
+		NotifyFold &fold = uf->folds[kind];
+		if (fold.until > Anope::CurTime)
 		{
-			source.Reply("%s is not currently a matched User.", u->nick.c_str());
-			return;
+			fold.Add(target);
+			return true;
 		}
 
-		NotifyList.DelMatch(u);
-		Log(LOG_ADMIN, source, this) << "to remove " << u->nick << " from the matched Users list for Notify";
-		source.Reply("%s has been removed the matched Users list.", u->nick.c_str());
+		/* A window that ended but wasn't summarized yet */
+		if (fold.until)
+			this->Summarize(uf, kind);
+
+		fold.Reset();
+		fold.until = Anope::CurTime + this->window;
+		open.insert(uf);
+
+		if (this->GetTimer() > fold.until)
+			this->SetSecs(this->window);
+
+		return false;
 	}
 
- public:
-	CommandOSNotify(Module *creator) : Command(creator, "operserv/notify", 1, 4)
+	/* Summarize everything folded for a User, used when they quit */
+	void FlushUser(User *u)
 	{
-		this->SetDesc("Manipulate the Notify (watch) list");
-		this->SetSyntax("ADD +\037expiry\037 \037flags\037 \037mask\037 [:]\037reason\037");
-		this->SetSyntax("DEL [\037mask\037 | \037entry-num\037 | \037list\037]");
-		this->SetSyntax("LIST [\037mask\037 | \037entry-num\037 | \037list\037]");
-		this->SetSyntax("VIEW [\037mask\037 | \037entry-num\037 | \037list\037]");
-		this->SetSyntax("CLEAR");
-		this->SetSyntax("SHOW [\037mask\037 | \037entry-num\037 | \037list\037]");
-		this->SetSyntax("REMOVE \037nick\037");
+		NotifyUserFolds *uf = userfolds.Get(u);
+		if (!uf)
+			return;
+
+		this->Flush(uf, true);
+		userfolds.Unset(u);
 	}
 
-	void Execute(CommandSource &source, const std::vector<Anope::string> &params) anope_override
+	void FlushAll()
 	{
-		const Anope::string &subcmd = params[0];
-
-		if (subcmd.equals_ci("ADD"))
-			this->DoAdd(source, params);
-		else if (subcmd.equals_ci("DEL"))
-			this->DoDel(source, params);
-		else if (subcmd.equals_ci("LIST"))
-			this->DoList(source, params);
-		else if (subcmd.equals_ci("VIEW"))
-			this->DoView(source, params);
-		else if (subcmd.equals_ci("CLEAR"))
-			this->DoClear(source, params);
-		else if (subcmd.equals_ci("SHOW"))
-			this->DoShow(source, params);
-		else if (subcmd.equals_ci("REMOVE"))
-			this->DoRemove(source, params);
-		else
-			this->OnSyntaxError(source, "");
+		while (!open.empty())
+			this->FlushUser((*open.begin())->user);
 	}
 
-	bool OnHelp(CommandSource &source, const Anope::string &subcommand) anope_override
+	void Forget(NotifyUserFolds *uf)
 	{
-		this->SendSyntax(source);
-		source.Reply(" ");
-		source.Reply("Notify allows Opers to create a list of masks that Users are matched against.\n"
-			     "Matching Users have many of their 'events' tracked and logged\n"
-			     "(typically to a log channel) for Opers to monitor.");
-		source.Reply(" ");
-		source.Reply("The \002ADD\002 command adds the given mask to the Notify list.\n"
-			     "Reason \002must\002 be given and the mask should be in the format of\n"
-			     "nick!user@host#real name (though all that is required is user@host) or\n"
-			     "#channel to track users that join a matching channel.\n"
-			     "If a real name is specified, the reason must be prepended with a :.\n"
-			     "Flags are used to decide what to track, for all use \037*\037.\n"
-			     "The available flags are:\n"
-			     "c - User Connections\nd - User Disconnections\n"
-			     "i - Channel Invites\nj - Channel Joins\n"
-			     "k - Channel Kicks\nm - Channel Modes\n"
-			     "n - User Nick changes\np - Channel Parts\n"
-			     "s - Most Services commands\nS - More Services commands\n"
-			     "t - Channel Topics\nu - User Modes\n"
-			     "\037expiry\037 is specified as an integer followed by one of \037d\37 (days),\n"
-			     " \037h\037 (hours), or \037m\037 (minutes). Combinations (such as \0371h30m\037)\n"
-			     "are not permitted. If a unit specifier is not included, the default is days\n"
-			     "(so \037+30\037 by itself means 30 days).\n"
-			     "To add a Notify which does not expire, use \037+0\037.");
+		open.erase(uf);
+	}
 
-		const Anope::string &regexengine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
-		if (!regexengine.empty())
+	void Tick(time_t) anope_override
+	{
+		std::vector<User *> done;
+		for (std::set<NotifyUserFolds *>::const_iterator it = open.begin(); it != open.end(); ++it)
 		{
-			source.Reply(" ");
-			source.Reply("Regex matches are also supported using the %s engine.\n"
-				     "Note that for a user mask, this will ONLY match against\n"
-				     "either \037user@host\037 or \037nick!user@host#real\037\n"
-				     "Enclose your pattern in // if this is desired.", regexengine.c_str());
+			if (!this->Flush(*it, false))
+				done.push_back((*it)->user);
 		}
 
-		source.Reply(" ");
-		source.Reply("The \002DEL\002 command requires a parameter, one of a mask to match,\n"
-			     "an entry number, or a list of entry numbers (1-5 or 1-3,5 format).\n"
-			     "The \002LIST\002 and \002VIEW\002 commands can be used with no\n"
-			     "parameters or with one of the above parameters, for DEL.\n");
-		source.Reply("The \002CLEAR\002 command clears all entries of the Notify list.");
-		source.Reply(" ");
-		source.Reply("The \002SHOW\002 command lists Notify masks with currently matched Users\n"
-			     "It can accept the same parameters as the \002LIST\002 and\n"
-			     "\002VIEW\002 commands, including no parameters at all.");
-		source.Reply("The \002REMOVE\002 command removes a user from the matched Users list.\n"
-			     "This can be useful if a user gets matched by a playful/silly nick change\n"
-			     "or as a temporary removal of tracking of the user.");
+		for (unsigned i = 0; i < done.size(); ++i)
+			userfolds.Unset(done[i]);
 
-		return true;
+		this->Schedule();
 	}
+};
 
-	void OnSyntaxError(CommandSource &source, const Anope::string &subcommand)
+/* Owned by the module, set while it is loaded */
+static NotifyFolder *NotifyFolding = NULL;
+
+NotifyUserFolds::~NotifyUserFolds()
+{
+	if (NotifyFolding)
+		NotifyFolding->Forget(this);
+}
+
+/* How OnPostCommand treats a Command, worked out once per Command */
+struct NotifyCommandInfo
+{
+	bool set;		/* A SET command, logged for the S flag instead of s */
+	bool hideparams;	/* Parameters are never logged */
+	bool invite;		/* Also reported as an invite */
+	Anope::string display;	/* Command name as users type it, e.g. "SET PASSWORD" */
+};
+
+/* Matches a slice of the User snapshots against the Notify list for Init() */
+class NotifyInitThread : public Thread
+{
+ public:
+	/* Target index and matching entry */
+	typedef std::pair<size_t, NotifyEntry *> Result;
+
+	/* Fewest targets worth giving a thread of its own */
+	static const size_t MinTargets = 1000;
+
+ private:
+	const std::vector<NotifyTarget> &targets;
+	size_t begin, end;
+
+ public:
+	std::vector<Result> results;
+	bool started;
+
+	NotifyInitThread(const std::vector<NotifyTarget> &t, size_t b, size_t e) : targets(t), begin(b), end(e), started(true) { }
+
+	static void MatchRange(const std::vector<NotifyTarget> &targets, size_t begin, size_t end, std::vector<Result> &results)
 	{
-		if (subcommand.equals_ci("ADD"))
-			source.Reply("ADD +\037expiry\037 \037flags\037 \037mask\037 [:]\037reason\037");
-		else if (subcommand.equals_ci("DEL"))
-			source.Reply("DEL [\037mask\037 | \037entry-num\037 | \037list\037]");
-		else if (subcommand.equals_ci("REMOVE"))
-			source.Reply("REMOVE \037nick\037");
-		else
-			this->SendSyntax(source);
+		std::vector<NotifyEntry *> candidates;
+		for (size_t i = begin; i < end; ++i)
+		{
+			NotifyList.GetCandidates(targets[i], candidates);
+			for (unsigned j = 0; j < candidates.size(); ++j)
+			{
+				if (candidates[j]->matcher.MatchesCompiled(targets[i]))
+					results.push_back(std::make_pair(i, candidates[j]));
+			}
+		}
+	}
+
+	void Run() anope_override
+	{
+		MatchRange(this->targets, this->begin, this->end, this->results);
 	}
 };
 
 class OSNotify : public Module
 {
 	Serialize::Type notifyentry_type;
+	ExtensibleItem<NotifyUserRecord> notifyrecords;
+	ExtensibleItem<NotifyChannelCache> notifychannels;
+	ExtensibleItem<NotifyUserStrings> notifystrings;
+	NotifyExpireTimer expiretimer;
 	CommandOSNotify commandosnotify;
 	BotInfo *OperServ;
-
-	const Anope::string BuildNUHR(const User *u)
-	{
-		if (!u)
-			return "unknown";
-
-		return Anope::string(u->nick + "!" + u->GetIdent() + "@" + u->host + "#" + u->realname);
-	}
+	unsigned init_threads;
+	NotifyLogQueue logqueue;
+	NotifyFolder folder;
+	std::vector<Anope::string> hideparams;
+	std::map<const Command *, NotifyCommandInfo> commands;	/* Classified on first use */
 
 	void NLog(const Anope::string &t, const char *m, ...)
 	{
@@ -914,41 +2767,104 @@ class OSNotify : public Module
 		va_list args;
 		va_start(args, m);
 		vsnprintf(buf, sizeof(buf), m, args);
-		Log(LOG_NORMAL, "notify/"+t, OperServ) << "NOTIFY: " << buf;
 		va_end(args);
+
+		logqueue.Push(t, buf);
 	}
 
+	/* Match all Users against the Notify list, used on sync.
+	 * The Users are copied into plain NotifyTargets and matched on up to
+	 * 'initthreads' threads, the results are then added on this thread.
+	 */
 	void Init()
 	{
 		const std::vector<NotifyEntry *> &notifies = NotifyList.GetNotifies();
 		if (notifies.empty())
 			return;
 
-		unsigned matches = 0;
+		struct timeval start;
+		gettimeofday(&start, NULL);
+
+		std::vector<NotifyTarget> targets;
+		targets.reserve(UserListByNick.size());
 		for (user_map::const_iterator uit = UserListByNick.begin(); uit != UserListByNick.end(); ++uit)
 		{
-			const User *u = uit->second;
+			User *u = uit->second;
 			if (!u || (u && u->server && u->server->IsULined()))
 				continue;
 
-			bool matched = false;
-			for (unsigned i = notifies.size(); i > 0; --i)
+			targets.push_back(NotifyTarget(u));
+		}
+
+		/* The threads must never compile a regex themselves */
+		NotifyList.PrepareRegexes();
+
+		size_t threads = std::min<size_t>(init_threads, targets.size() / NotifyInitThread::MinTargets);
+		if (threads < 1)
+			threads = 1;
+
+		std::vector<NotifyInitThread::Result> results;
+		if (threads == 1)
+		{
+			NotifyInitThread::MatchRange(targets, 0, targets.size(), results);
+		}
+		else
+		{
+			std::vector<NotifyInitThread *> workers;
+			const size_t slice = (targets.size() + threads - 1) / threads;
+			for (size_t begin = 0; begin < targets.size(); begin += slice)
 			{
-				const NotifyEntry *ne = notifies.at(i - 1);
-				if (!ne)
-					continue;
+				NotifyInitThread *worker = new NotifyInitThread(targets, begin, std::min(begin + slice, targets.size()));
+				workers.push_back(worker);
 
-				if (NotifyList.Check(u, ne->mask))
+				try
 				{
-					NotifyList.AddMatch(u, ne);
-					matched = true;
+					worker->Start();
+				}
+				catch (const CoreException &ex)
+				{
+					Log(LOG_DEBUG) << "os_notify: " << ex.GetReason() << ", matching on the main thread instead";
+					worker->Run();
+					worker->started = false;
 				}
 			}
 
-			if (matched)
+			for (unsigned i = 0; i < workers.size(); ++i)
+			{
+				NotifyInitThread *worker = workers[i];
+				if (worker->started)
+					worker->Join();
+
+				results.insert(results.end(), worker->results.begin(), worker->results.end());
+				delete worker;
+			}
+		}
+
+		/* Results are ordered by target, so each matched User is counted once */
+		unsigned matches = 0;
+		size_t last = targets.size();
+		for (unsigned i = 0; i < results.size(); ++i)
+		{
+			const NotifyTarget &t = targets[results[i].first];
+			const NotifyEntry *ne = results[i].second;
+
+			if (NotifyList.ExistsAlready(t.user, ne))
+				continue;
+
+			NotifyList.AddMatch(t.user, ne);
+			if (results[i].first != last)
+			{
+				last = results[i].first;
 				matches++;
+			}
 		}
 
+		struct timeval end;
+		gettimeofday(&end, NULL);
+		const long elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+		Log(LOG_DEBUG) << "os_notify: Matched " << targets.size() << " user(s) against " << notifies.size() << " notify entries in "
+			<< elapsed << "ms using " << threads << " thread(s)";
+
 		if (matches > 0)
 			NLog("user", "Matched %d user(s) against the Notify list", matches);
 	}
@@ -959,27 +2875,105 @@ class OSNotify : public Module
 		if (!u || (wantChan && !c) || notifies.empty() || (u->server && u->server->IsULined()))
 			return 0;
 
-		unsigned matches = 0;
-		for (unsigned i = notifies.size(); i > 0; --i)
+		/* Channel matches are already confirmed by the channel index */
+		if (wantChan)
+			return this->AddMatches(u, NotifyList.GetChannelMatches(c));
+
+		/* Only check the candidates from the user mask index */
+		const NotifyTarget target(u);
+		std::vector<NotifyEntry *> candidates;
+		NotifyList.GetCandidates(target, candidates);
+
+		std::vector<NotifyEntry *>::iterator it = candidates.begin();
+		while (it != candidates.end())
 		{
-			const NotifyEntry *ne = notifies.at(i - 1);
-			if (!ne)
-				continue;
+			if (NotifyList.Check(target, *it))
+				++it;
+			else
+				it = candidates.erase(it);
+		}
 
-			bool matched = false;
-			if (wantChan && c)
-				matched = NotifyList.Check(c, ne->mask);
-			else if (!wantChan)
-				matched = NotifyList.Check(u, ne->mask);
+		return this->AddMatches(u, candidates);
+	}
 
-			if (matched)
-			{
-				if (NotifyList.ExistsAlready(u, ne))
-					continue;
+	const NotifyCommandInfo &ClassifyCommand(const Command *command)
+	{
+		std::map<const Command *, NotifyCommandInfo>::iterator it = commands.find(command);
+		if (it != commands.end())
+			return it->second;
 
-				NotifyList.AddMatch(u, ne);
-				matches++;
-			}
+		const Anope::string &cmd = command->name;
+		NotifyCommandInfo &info = commands[command];
+		info.set = Anope::Match(cmd, "*/set/*");
+		info.hideparams = std::find(hideparams.begin(), hideparams.end(), cmd) != hideparams.end();
+		info.invite = (cmd == "chanserv/invite");
+		info.display = cmd.substr(cmd.find('/') + 1).replace_all_ci("/", " ").upper();
+
+		return info;
+	}
+
+	/* Re-match a User against the user masks after their host, ident or
+	 * realname changed. Only the candidates from the index are checked,
+	 * channel mask matches are left alone.
+	 */
+	void Rematch(User *u, unsigned &added, unsigned &removed)
+	{
+		added = removed = 0;
+		if (!Me || !Me->IsSynced() || NotifyList.GetNotifies().empty() || (u->server && u->server->IsULined()))
+			return;
+
+		const NotifyTarget target(u);
+		std::vector<NotifyEntry *> candidates;
+		NotifyList.GetCandidates(target, candidates);
+
+		std::vector<NotifyEntry *> matched;
+		for (unsigned i = 0; i < candidates.size(); ++i)
+		{
+			if (NotifyList.Check(target, candidates[i]))
+				matched.push_back(candidates[i]);
+		}
+
+		std::vector<const NotifyEntry *> stale;
+		const NotifyUserRecord *rec = NotifyRecords->Get(u);
+		for (unsigned i = 0; rec && i < rec->matches.size(); ++i)
+		{
+			const NotifyEntry *ne = rec->matches[i]->entry;
+			if (!ne->matcher.IsChannel() && !std::binary_search(matched.begin(), matched.end(), ne))
+				stale.push_back(ne);
+		}
+
+		for (unsigned i = 0; i < stale.size(); ++i)
+			NotifyList.DelMatch(u, stale[i]);
+
+		removed = stale.size();
+		added = this->AddMatches(u, matched);
+	}
+
+	void RematchAndLog(User *u, const char *what, const Anope::string &value)
+	{
+		unsigned added, removed;
+		this->Rematch(u, added, removed);
+
+		if (added > 0 && removed > 0)
+			NLog("user", "'%s' changed %s to %s [matches %d new Notify mask(s), no longer matches %d]", BuildNUHR(u).c_str(), what, value.c_str(), added, removed);
+		else if (added > 0)
+			NLog("user", "'%s' changed %s to %s [matches %d new Notify mask(s)]", BuildNUHR(u).c_str(), what, value.c_str(), added);
+		else if (removed > 0)
+			NLog("user", "'%s' changed %s to %s [no longer matches %d Notify mask(s)]", BuildNUHR(u).c_str(), what, value.c_str(), removed);
+	}
+
+	/* Match a User to the given entries, returning how many were new */
+	unsigned AddMatches(User *u, const std::vector<NotifyEntry *> &entries)
+	{
+		unsigned matches = 0;
+		for (unsigned i = entries.size(); i > 0; --i)
+		{
+			const NotifyEntry *ne = entries.at(i - 1);
+			if (!ne || NotifyList.ExistsAlready(u, ne))
+				continue;
+
+			NotifyList.AddMatch(u, ne);
+			matches++;
 		}
 
 		return matches;
@@ -987,21 +2981,64 @@ class OSNotify : public Module
 
  public:
 	OSNotify(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, THIRD),
-		notifyentry_type("Notify", NotifyEntry::Unserialize), commandosnotify(this), OperServ(NULL)
+		notifyentry_type("Notify", NotifyEntry::Unserialize), notifyrecords(this, "notify_record"), notifychannels(this, "notify_channel"), notifystrings(this, "notify_strings"), expiretimer(this), commandosnotify(this), OperServ(NULL), init_threads(1), folder(this, logqueue)
 	{
 		if (Anope::VersionMajor() != 2 || Anope::VersionMinor() != 0)
 			throw ModuleException("Requires version 2.0.x of Anope.");
 
+		NotifyRecords = &notifyrecords;
+		NotifyChannels = &notifychannels;
+		NotifyStrings = &notifystrings;
+		NotifyExpiry = &expiretimer;
+		NotifyFolding = &folder;
+		NotifyList.ExpireDue();
+
 		this->SetAuthor("genius3000");
-		this->SetVersion("1.2.1");
+		this->SetVersion("1.3.0");
 
 		if (Me && Me->IsSynced())
 			this->Init();
 	}
 
+	~OSNotify()
+	{
+		folder.FlushAll();
+		logqueue.Flush();
+		NotifyFolding = NULL;
+
+		NotifyRecords = NULL;
+		NotifyChannels = NULL;
+		NotifyStrings = NULL;
+		NotifyExpiry = NULL;
+	}
+
 	void OnReload(Configuration::Conf *conf) anope_override
 	{
 		OperServ = conf->GetClient("OperServ");
+		init_threads = conf->GetModule(this)->Get<unsigned>("initthreads", "4");
+		logqueue.bot = OperServ;
+		logqueue.SetSize(conf->GetModule(this)->Get<unsigned>("logqueue", "512"));
+		folder.window = Anope::DoTime(conf->GetModule(this)->Get<const Anope::string>("foldtime", "5s"));
+
+		hideparams.clear();
+		spacesepstream sep(conf->GetModule(this)->Get<const Anope::string>("hideparams", "nickserv/register nickserv/identify nickserv/confirm "
+			"nickserv/group nickserv/recover nickserv/set/password nickserv/cert memoserv/send memoserv/rsend memoserv/staff"));
+		Anope::string cmd;
+		while (sep.GetToken(cmd))
+			hideparams.push_back(cmd);
+		commands.clear();
+
+		/* The regex engine may have changed, recompile on next use */
+		NotifyList.ReleaseRegexes();
+	}
+
+	void OnModuleUnload(User *, Module *m) anope_override
+	{
+		/* Compiled regexes belong to the regex engine module */
+		NotifyList.ReleaseRegexes();
+
+		/* The module's Commands are going away with it */
+		commands.clear();
 	}
 
 	void OnUplinkSync(Server *) anope_override
@@ -1017,25 +3054,52 @@ class OSNotify : public Module
 		unsigned matches = CheckUserOrChannel(u);
 		if (matches > 0)
 		{
-			if (NotifyList.HasFlag(u, 'c'))
+			if (NotifyList.WantsEvent(u, NF_CONNECT))
 				NLog("user", "'%s' connected [matches %d Notify mask(s)]", BuildNUHR(u).c_str(), matches);
 		}
 	}
 
 	void OnUserQuit(User *u, const Anope::string &msg) anope_override
 	{
+		folder.FlushUser(u);
+
 		if (NotifyList.IsMatch(u))
 		{
-			if (NotifyList.HasFlag(u, 'd'))
+			if (NotifyList.WantsEvent(u, NF_DISCONNECT))
 				NLog("user", "'%s' disconnected (reason: %s)", BuildNUHR(u).c_str(), msg.c_str());
 
 			NotifyList.DelMatch(u);
 		}
 	}
 
+	/* Hacky way to catch IDENT and realname changes */
+	void OnLog(Log *l) anope_override
+	{
+		if (l->type != LOG_USER || !l->u)
+			return;
+
+		if (l->category == "ident")
+		{
+			notifystrings.Unset(l->u);
+			RematchAndLog(l->u, "ident", l->u->GetIdent());
+		}
+		else if (l->category == "realname")
+		{
+			notifystrings.Unset(l->u);
+			RematchAndLog(l->u, "realname", l->u->realname);
+		}
+	}
+
+	/* vHosts, cloaks and CHGHOST */
+	void OnSetDisplayedHost(User *u) anope_override
+	{
+		RematchAndLog(u, "displayed host", u->GetDisplayedHost());
+	}
+
 	void OnUserNickChange(User *u, const Anope::string &oldnick) anope_override
 	{
 		const Anope::string nuhr = oldnick + "!" + u->GetIdent() + "@" + u->host + "#" + u->realname;
+		notifystrings.Unset(u);
 		bool oldmatch = false;
 
 		if (NotifyList.IsMatch(u))
@@ -1043,7 +3107,7 @@ class OSNotify : public Module
 
 		unsigned matches = CheckUserOrChannel(u);
 
-		if (!NotifyList.HasFlag(u, 'n'))
+		if (!NotifyList.WantsEvent(u, NF_NICK))
 			return;
 
 		if (matches > 0)
@@ -1066,7 +3130,7 @@ class OSNotify : public Module
 
 		unsigned matches = CheckUserOrChannel(u, c, true);
 
-		if (!NotifyList.HasFlag(u, 'j'))
+		if (!NotifyList.WantsEvent(u, NF_JOIN))
 			return;
 
 		if (matches > 0)
@@ -1076,13 +3140,13 @@ class OSNotify : public Module
 			else
 				NLog("channel", "'%s' joined %s [matches %d Notify mask(s)]", BuildNUHR(u).c_str(), c->name.c_str(), matches);
 		}
-		else if (oldmatch)
+		else if (oldmatch && !folder.Fold(u, NFK_JOIN, c->name))
 			NLog("channel", "'%s' joined %s", BuildNUHR(u).c_str(), c->name.c_str());
 	}
 
 	void OnPartChannel(User *u, Channel *c, const Anope::string &channel, const Anope::string &msg) anope_override
 	{
-		if (NotifyList.HasFlag(u, 'p'))
+		if (NotifyList.WantsEvent(u, NF_PART) && !folder.Fold(u, NFK_PART, c->name))
 			NLog("channel", "'%s' parted %s (reason: %s)", BuildNUHR(u).c_str(), c->name.c_str(), msg.c_str());
 	}
 
@@ -1090,44 +3154,46 @@ class OSNotify : public Module
 	{
 		User *u = source.GetUser();
 
-		if (NotifyList.HasFlag(target, 'k'))
+		if (NotifyList.WantsEvent(target, NF_KICK))
 			NLog("channel", "'%s' was kicked from %s by %s (reason: %s)", BuildNUHR(target).c_str(), channel.c_str(), (u ? u->nick.c_str() : "unknown"), kickmsg.c_str());
 
-		if (u && NotifyList.HasFlag(u, 'k'))
+		if (u && NotifyList.WantsEvent(u, NF_KICK))
 			NLog("channel", "'%s' kicked %s from %s (reason: %s)", BuildNUHR(u).c_str(), target->nick.c_str(), channel.c_str(), kickmsg.c_str());
 	}
 
 	void OnUserMode(const MessageSource &setter, User *u, const Anope::string &mname, bool setting)
 	{
-		const Anope::string &nuhr = BuildNUHR(u);
 		UserMode *um = ModeManager::FindUserModeByName(mname);
 
 		if (setter.GetUser() && setter.GetUser() != u)
-			NLog("user", "%s %sset mode %c (%s) on '%s'", setter.GetUser()->nick.c_str(), (setting ? "" : "un"), (um ? um->mchar : '\0'), mname.c_str(), nuhr.c_str());
-		else
-			NLog("user", "'%s' %sset mode %c (%s)", nuhr.c_str(), (setting ? "" : "un"), (um ? um->mchar : '\0'), mname.c_str());
+			NLog("user", "%s %sset mode %c (%s) on '%s'", setter.GetUser()->nick.c_str(), (setting ? "" : "un"), (um ? um->mchar : '\0'), mname.c_str(), BuildNUHR(u).c_str());
+		else if (!folder.Fold(u, NFK_USERMODE, (setting ? "+" : "-") + mname))
+			NLog("user", "'%s' %sset mode %c (%s)", BuildNUHR(u).c_str(), (setting ? "" : "un"), (um ? um->mchar : '\0'), mname.c_str());
 	}
 
 	void OnUserModeSet(const MessageSource &setter, User *u, const Anope::string &mname) anope_override
 	{
-		if (NotifyList.HasFlag(u, 'u'))
+		if (NotifyList.WantsEvent(u, NF_USERMODE))
 			OnUserMode(setter, u, mname, true);
 	}
 
 	void OnUserModeUnset(const MessageSource &setter, User *u, const Anope::string &mname) anope_override
 	{
-		if (NotifyList.HasFlag(u, 'u'))
+		if (NotifyList.WantsEvent(u, NF_USERMODE))
 			OnUserMode(setter, u, mname, false);
 	}
 
 	void OnChannelMode(Channel *c, MessageSource &setter, ChannelMode *mode, const Anope::string &param, bool setting)
 	{
-		const User *u = setter.GetUser();
+		User *u = setter.GetUser();
 		if (!u)
 			return;
 
-		if (NotifyList.HasFlag(u, 'm'))
+		if (NotifyList.WantsEvent(u, NF_CHANMODE))
 		{
+			if (folder.Fold(u, NFK_CHANMODE, c->name))
+				return;
+
 			if (mode->type == MODE_STATUS)
 			{
 				const User *target = User::Find(param, false);
@@ -1139,7 +3205,7 @@ class OSNotify : public Module
 		else if (mode->type == MODE_STATUS)
 		{
 			const User *target = User::Find(param, false);
-			if (target && NotifyList.HasFlag(target, 'm'))
+			if (target && NotifyList.WantsEvent(target, NF_CHANMODE))
 				NLog("channel", "%s %sset channel mode %c (%s) on '%s' on %s", u->nick.c_str(), (setting ? "" : "un"), mode->mchar, mode->name.c_str(), BuildNUHR(target).c_str(), c->name.c_str());
 		}
 	}
@@ -1166,7 +3232,7 @@ class OSNotify : public Module
 
 		const User *u = source ? source : User::Find(user, false);
 
-		if (u && NotifyList.HasFlag(u, 't'))
+		if (u && NotifyList.WantsEvent(u, NF_TOPIC))
 			NLog("channel", "'%s' changed topic on %s to %s", BuildNUHR(u).c_str(), c->name.c_str(), topic.c_str());
 	}
 
@@ -1175,11 +3241,11 @@ class OSNotify : public Module
 		User *src = User::Find(source, false);
 		User *dst = User::Find(target, false);
 
-		if (src && NotifyList.HasFlag(src, 'i'))
+		if (src && NotifyList.WantsEvent(src, NF_INVITE))
 		{
 			NLog("channel", "'%s' invited %s to %s", BuildNUHR(src).c_str(), (dst ? dst->nick.c_str() : target.c_str()), chan.c_str());
 		}
-		else if (dst && NotifyList.HasFlag(dst, 'i'))
+		else if (dst && NotifyList.WantsEvent(dst, NF_INVITE))
 		{
 			NLog("channel", "%s invited '%s' to %s", (src ? src->nick.c_str() : source.c_str()), BuildNUHR(dst).c_str(), chan.c_str());
 		}
@@ -1191,27 +3257,22 @@ class OSNotify : public Module
 		if (!u)
 			return;
 
-		const Anope::string &cmd = command->name;
-		if (cmd == "chanserv/invite" && !params.empty())
+		const NotifyCommandInfo &info = ClassifyCommand(command);
+		if (info.invite && !params.empty())
 			UserInvite(source.GetNick(), (params.size() > 1 ? params[1] : source.GetNick()), params[0]);
 
-		if ((!NotifyList.HasFlag(u, 's') && !Anope::Match(cmd, "*/set/*")) ||
-		    (!NotifyList.HasFlag(u, 'S') && Anope::Match(cmd, "*/set/*")))
+		if (!NotifyList.WantsEvent(u, info.set ? NF_SETCOMMAND : NF_COMMAND))
 			return;
 
 		Anope::string strparams;
-		if (!params.empty() && cmd != "nickserv/register" && cmd != "nickserv/identify" && cmd != "nickserv/confirm" &&
-		    cmd != "nickserv/group" && cmd != "nickserv/recover" && cmd != "nickserv/set/password" &&
-		    cmd != "nickserv/cert" && cmd != "memoserv/send" && cmd != "memoserv/rsend" && cmd != "memoserv/staff")
+		if (!params.empty() && !info.hideparams)
 		{
 			for (unsigned i = 0; i < params.size(); ++i)
 				strparams.append(params[i] + " ");
 			strparams.rtrim(" ");
 		}
 
-		const Anope::string scmd = source.service->nick + " " + cmd.substr(cmd.find('/') + 1).replace_all_ci("/", " ").upper();
-
-		NLog("commands", "'%s' used %s [%s]", BuildNUHR(u).c_str(), scmd.c_str(), (strparams.empty() ? "" : strparams.c_str()));
+		NLog("commands", "'%s' used %s %s [%s]", BuildNUHR(u).c_str(), source.service->nick.c_str(), info.display.c_str(), (strparams.empty() ? "" : strparams.c_str()));
 	}
 
 	EventReturn OnMessage(MessageSource &source, Anope::string &command, std::vector<Anope::string> &params) anope_override